@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Microbenchmark for FindDouble() compared with
+ * std::string_view::find(), measuring the throughput of searching
+ * "{{" in inputs with various brace densities.
+ */
+
+#include "FindDouble.hxx"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+using std::string_view_literals::operator""sv;
+
+static constexpr std::size_t INPUT_SIZE = 1024 * 1024;
+
+/**
+ * Repeat the given pattern until the string has #INPUT_SIZE bytes,
+ * and append one "{{" at the very end (so the whole input must be
+ * scanned).
+ */
+static std::string MakeInput(std::string_view pattern) {
+    std::string s;
+    s.reserve(INPUT_SIZE + 2);
+    while (s.size() < INPUT_SIZE)
+        s.append(pattern);
+    s.resize(INPUT_SIZE);
+    s.append("{{"sv);
+    return s;
+}
+
+template <typename F>
+static double Measure(std::string_view input, F &&f) {
+    using Clock = std::chrono::steady_clock;
+
+    std::size_t total = 0, result = 0;
+    const auto start = Clock::now();
+    Clock::duration elapsed;
+
+    do {
+        for (unsigned i = 0; i < 16; ++i) {
+            result += f(input);
+            total += input.size();
+        }
+
+        elapsed = Clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds{500});
+
+    if (result == 0)
+        fputs("unexpected result\n", stderr);
+
+    return total / std::chrono::duration<double>(elapsed).count();
+}
+
+static void Run(const char *name, std::string_view pattern) {
+    const auto input = MakeInput(pattern);
+
+    const double simd = Measure(
+        input, [](std::string_view s) { return FindDouble(s, '{'); });
+    const double find = Measure(
+        input, [](std::string_view s) { return s.find("{{"sv); });
+
+    printf("%-12s FindDouble %8.1f MB/s  string_view::find %8.1f MB/s\n",
+           name, simd / 1e6, find / 1e6);
+}
+
+int main() {
+    Run("plain", "Lorem ipsum dolor sit amet, consectetur adipiscing.\n"sv);
+    Run("css", ".a{color:red}\n#b > p { margin: 0 }\n"sv);
+    Run("js", "function f(a){if(a){g({x:1});}}\n"sv);
+    Run("braces", "{}{x}{ }"sv);
+    return 0;
+}
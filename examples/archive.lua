@@ -0,0 +1,9 @@
+-- skeleton.tar.zst contains "index.html" (a template referring to
+-- "name") and "css/style.css"; it was created with:
+--
+--   tar --sort=name --owner=0 --group=0 --mtime=@0 --format=ustar \
+--       -cf - index.html css | zstd -19 -o skeleton.tar.zst
+
+name="world"
+extract_archive(src/"skeleton.tar.zst", make_directory(path/"site"),
+                {template="*.html"})
@@ -0,0 +1,8 @@
+copy = async_recursive_copy(src/"../src", make_directory(path/"async/src"))
+hash = async_pwhash("secret")
+
+name = "async"
+copy_template(src/"template.txt", path/"async/with_template")
+
+_, h = await(copy, hash)
+print("hash", h)
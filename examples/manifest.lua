@@ -0,0 +1,6 @@
+recursive_copy(src/"../src", make_directory(path/"manifest"))
+write_manifest(path/"manifest", "/tmp/manifest.txt")
+
+for _, difference in ipairs(verify_manifest(path/"manifest", "/tmp/manifest.txt")) do
+   print(difference)
+end
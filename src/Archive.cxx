@@ -0,0 +1,727 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Archive.hxx"
+#include "Metrics.hxx"
+#include "Path.hxx"
+#include "Template.hxx"
+#include "config.h"
+#include "io/FileWriter.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "system/Error.hxx"
+#include "util/SpanCast.hxx"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string_view_literals::operator""sv;
+
+static constexpr std::size_t TAR_BLOCK_SIZE = 512;
+
+/**
+ * Templates are loaded into memory; this is the same limit as in
+ * copy_template().
+ */
+static constexpr std::size_t MAX_TEMPLATE_SIZE = 1024 * 1024;
+
+/**
+ * Read the archive file sequentially, decompressing it on the fly
+ * if it is zstd-compressed.
+ */
+class ArchiveInput {
+    const UniqueFileDescriptor fd;
+
+    std::array<std::byte, 65536> buffer;
+    std::size_t buffer_position = 0, buffer_fill = 0;
+
+    bool eof = false;
+
+#ifdef HAVE_ZSTD
+    struct DCtxDeleter {
+        void operator()(ZSTD_DCtx *dctx) const noexcept {
+            ZSTD_freeDCtx(dctx);
+        }
+    };
+
+    std::unique_ptr<ZSTD_DCtx, DCtxDeleter> zstd;
+#endif
+
+  public:
+    explicit ArchiveInput(UniqueFileDescriptor &&_fd);
+
+    /**
+     * Fill the whole buffer.  Throws on I/O error or premature end
+     * of file.
+     */
+    void ReadFull(std::span<std::byte> dest);
+
+    void Skip(std::size_t size) {
+        std::array<std::byte, 8192> discard;
+        while (size > 0) {
+            const std::size_t n = std::min(size, discard.size());
+            ReadFull(std::span{discard}.first(n));
+            size -= n;
+        }
+    }
+
+  private:
+    /**
+     * Refill #buffer from the file.
+     *
+     * @return false on end of file
+     */
+    bool FillBuffer();
+
+    /**
+     * Copy (uncompressed) data from the file to the given buffer.
+     *
+     * @return the number of bytes (0 on end of file)
+     */
+    std::size_t Read(std::span<std::byte> dest);
+};
+
+ArchiveInput::ArchiveInput(UniqueFileDescriptor &&_fd) : fd(std::move(_fd)) {
+    posix_fadvise(fd.Get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!FillBuffer())
+        return;
+
+    static constexpr std::array<std::byte, 4> zstd_magic{
+        std::byte{0x28}, std::byte{0xb5}, std::byte{0x2f}, std::byte{0xfd}};
+    if (buffer_fill >= zstd_magic.size() &&
+        std::equal(zstd_magic.begin(), zstd_magic.end(), buffer.begin())) {
+#ifdef HAVE_ZSTD
+        zstd.reset(ZSTD_createDCtx());
+        if (!zstd)
+            throw std::bad_alloc{};
+#else
+        throw std::runtime_error{"zstd support is disabled"};
+#endif
+    }
+}
+
+bool ArchiveInput::FillBuffer() {
+    if (eof)
+        return false;
+
+    auto nbytes = read(fd.Get(), buffer.data(), buffer.size());
+    if (nbytes < 0)
+        throw MakeErrno("Failed to read archive");
+
+    buffer_position = 0;
+    buffer_fill = nbytes;
+    eof = nbytes == 0;
+    return !eof;
+}
+
+std::size_t ArchiveInput::Read(std::span<std::byte> dest) {
+#ifdef HAVE_ZSTD
+    if (zstd) {
+        ZSTD_outBuffer out{dest.data(), dest.size(), 0};
+
+        while (out.pos == 0) {
+            if (buffer_position == buffer_fill && !FillBuffer())
+                return 0;
+
+            ZSTD_inBuffer in{buffer.data(), buffer_fill, buffer_position};
+            const auto result = ZSTD_decompressStream(zstd.get(), &out, &in);
+            if (ZSTD_isError(result))
+                throw FmtRuntimeError("Failed to decompress archive: {}",
+                                      ZSTD_getErrorName(result));
+
+            buffer_position = in.pos;
+        }
+
+        return out.pos;
+    }
+#endif
+
+    if (buffer_position == buffer_fill && !FillBuffer())
+        return 0;
+
+    const std::size_t n = std::min(dest.size(), buffer_fill - buffer_position);
+    std::copy_n(buffer.begin() + buffer_position, n, dest.begin());
+    buffer_position += n;
+    return n;
+}
+
+void ArchiveInput::ReadFull(std::span<std::byte> dest) {
+    while (!dest.empty()) {
+        const std::size_t n = Read(dest);
+        if (n == 0)
+            throw std::runtime_error{"Truncated archive"};
+
+        dest = dest.subspan(n);
+    }
+}
+
+/**
+ * The POSIX ustar header.
+ */
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE);
+
+[[gnu::pure]]
+static std::string_view FieldToStringView(const char *s,
+                                          std::size_t max_length) noexcept {
+    return {s, strnlen(s, max_length)};
+}
+
+/**
+ * Parse a numeric header field: octal or (GNU extension) base-256.
+ */
+static uint_least64_t ParseNumber(std::span<const char> field) {
+    if (!field.empty() && (field.front() & 0x80) != 0) {
+        uint_least64_t value = field.front() & 0x7f;
+        for (char ch : field.subspan(1))
+            value = (value << 8) | static_cast<unsigned char>(ch);
+        return value;
+    }
+
+    uint_least64_t value = 0;
+    for (char ch : field) {
+        if (ch == ' ')
+            continue;
+        if (ch == 0)
+            break;
+        if (ch < '0' || ch > '7')
+            throw std::runtime_error{"Malformed number in tar header"};
+        value = (value << 3) | (ch - '0');
+    }
+
+    return value;
+}
+
+static bool IsEndOfArchive(const TarHeader &header) noexcept {
+    const auto *p = reinterpret_cast<const std::byte *>(&header);
+    return std::all_of(p, p + sizeof(header),
+                       [](std::byte b) { return b == std::byte{}; });
+}
+
+static void VerifyChecksum(const TarHeader &header) {
+    const auto *p = reinterpret_cast<const unsigned char *>(&header);
+
+    unsigned sum = 0;
+    for (std::size_t i = 0; i < sizeof(header); ++i)
+        sum += p[i];
+
+    /* the checksum field itself counts as spaces */
+    for (char ch : header.checksum)
+        sum -= static_cast<unsigned char>(ch);
+    sum += sizeof(header.checksum) * ' ';
+
+    if (sum != ParseNumber(header.checksum))
+        throw std::runtime_error{"Bad tar header checksum"};
+}
+
+static constexpr std::size_t PadToBlock(std::size_t size) noexcept {
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+/**
+ * Normalize a member name and make sure it does not escape from the
+ * destination directory.
+ *
+ * @return the normalized name (may be empty for the archive root)
+ */
+static std::string_view CheckMemberName(std::string_view name) {
+    while (name.starts_with("./"sv))
+        name.remove_prefix(2);
+    while (name.ends_with('/'))
+        name.remove_suffix(1);
+    if (name == "."sv)
+        name = {};
+
+    if (name.starts_with('/'))
+        throw FmtRuntimeError("Absolute path in archive: {}", name);
+
+    for (std::string_view rest = name; !rest.empty();) {
+        const auto slash = rest.find('/');
+        const auto segment = rest.substr(0, slash);
+        if (segment == ".."sv)
+            throw FmtRuntimeError("Illegal path in archive: {}", name);
+        if (slash == rest.npos)
+            break;
+        rest = rest.substr(slash + 1);
+    }
+
+    return name;
+}
+
+/**
+ * Parse a pax extended header and extract the "path" and
+ * "linkpath" records (all others are ignored).
+ */
+static void ParsePaxHeader(std::string_view data, std::string &path,
+                           std::string &linkpath) {
+    while (!data.empty()) {
+        /* each record is "LENGTH KEY=VALUE\n" */
+        const auto space = data.find(' ');
+        if (space == data.npos)
+            break;
+
+        std::size_t length = 0;
+        for (char ch : data.substr(0, space)) {
+            if (ch < '0' || ch > '9')
+                throw std::runtime_error{"Malformed pax header"};
+            length = length * 10 + (ch - '0');
+        }
+
+        if (length <= space + 1 || length > data.size())
+            throw std::runtime_error{"Malformed pax header"};
+
+        auto record = data.substr(space + 1, length - space - 2);
+        data = data.substr(length);
+
+        const auto eq = record.find('=');
+        if (eq == record.npos)
+            continue;
+
+        const auto key = record.substr(0, eq);
+        const auto value = record.substr(eq + 1);
+        if (key == "path"sv)
+            path = value;
+        else if (key == "linkpath"sv)
+            linkpath = value;
+    }
+}
+
+/**
+ * A member of a tar archive, with all extended headers applied.
+ */
+struct ArchiveMember {
+    char type;
+
+    /**
+     * The normalized name (see CheckMemberName()).
+     */
+    std::string name;
+
+    std::string link_target;
+
+    mode_t mode;
+
+    std::size_t size;
+};
+
+/**
+ * Iterates over the members of a tar archive.
+ */
+class ArchiveReader {
+    ArchiveInput input;
+
+    /**
+     * The number of data bytes (plus padding) of the current member
+     * which have not been read yet.
+     */
+    std::size_t data_remaining = 0, padding = 0;
+
+    std::string extended_data;
+
+  public:
+    explicit ArchiveReader(UniqueFileDescriptor &&fd) : input(std::move(fd)) {}
+
+    /**
+     * Read the header of the next member, skipping the unread data
+     * of the current one.
+     *
+     * @return false at the end of the archive
+     */
+    bool Next(ArchiveMember &member);
+
+    /**
+     * Read data of the current member.
+     */
+    void ReadData(std::span<std::byte> dest) {
+        if (dest.size() > data_remaining)
+            throw std::runtime_error{"Read past end of tar member"};
+
+        input.ReadFull(dest);
+        data_remaining -= dest.size();
+    }
+
+    /**
+     * Read all data of the current (template) member into a
+     * string.
+     */
+    std::string ReadTemplate(const ArchiveMember &member) {
+        if (member.size > MAX_TEMPLATE_SIZE)
+            throw FmtRuntimeError("File too large: {}", member.name);
+
+        std::string data;
+        data.resize(member.size);
+        ReadData(std::as_writable_bytes(std::span{data}));
+        return data;
+    }
+};
+
+bool ArchiveReader::Next(ArchiveMember &member) {
+    input.Skip(data_remaining + padding);
+    data_remaining = padding = 0;
+
+    /* from GNU "L"/"K" or pax "x" headers; they apply to the next
+       member */
+    std::string long_name, long_link;
+
+    while (true) {
+        TarHeader header;
+        input.ReadFull(std::as_writable_bytes(std::span{&header, 1}));
+
+        if (IsEndOfArchive(header))
+            return false;
+
+        VerifyChecksum(header);
+
+        const std::size_t size = ParseNumber(header.size);
+
+        switch (header.type) {
+        case 'L':
+        case 'K':
+        case 'x':
+            if (size > MAX_TEMPLATE_SIZE)
+                throw std::runtime_error{"Extended tar header too large"};
+
+            extended_data.resize(size);
+            input.ReadFull(std::as_writable_bytes(std::span{extended_data}));
+            input.Skip(PadToBlock(size));
+
+            if (header.type == 'L')
+                long_name = FieldToStringView(extended_data.data(),
+                                              extended_data.size());
+            else if (header.type == 'K')
+                long_link = FieldToStringView(extended_data.data(),
+                                              extended_data.size());
+            else
+                ParsePaxHeader(extended_data, long_name, long_link);
+            continue;
+
+        case 'g':
+            /* pax global header: ignore */
+            input.Skip(size + PadToBlock(size));
+            continue;
+        }
+
+        std::string raw_name;
+        if (!long_name.empty()) {
+            raw_name = std::move(long_name);
+        } else {
+            const auto prefix = FieldToStringView(header.prefix,
+                                                  sizeof(header.prefix));
+            if (!prefix.empty()) {
+                raw_name = prefix;
+                raw_name.push_back('/');
+            }
+
+            raw_name += FieldToStringView(header.name, sizeof(header.name));
+        }
+
+        member.type = header.type;
+        member.name = CheckMemberName(raw_name);
+
+        if (!long_link.empty())
+            member.link_target = std::move(long_link);
+        else
+            member.link_target = FieldToStringView(header.linkname,
+                                                   sizeof(header.linkname));
+
+        /* setuid/setgid/sticky bits are not extracted on purpose:
+           the archive may come from an untrusted source */
+        member.mode = ParseNumber(header.mode) & 0777;
+        member.size = size;
+
+        data_remaining = size;
+        padding = PadToBlock(size);
+        return true;
+    }
+}
+
+/**
+ * Creates files relative to the destination directory.  The file
+ * descriptor of the most recently used parent directory is cached,
+ * because tar archives are usually sorted by directory.
+ */
+class ArchiveWriter {
+    const FileDescriptor root;
+
+    std::string parent_path;
+    UniqueFileDescriptor parent_fd;
+
+  public:
+    explicit ArchiveWriter(FileDescriptor _root) noexcept : root(_root) {}
+
+    void MakeDirectory(std::string_view name, mode_t mode);
+    void MakeSymlink(std::string_view name, const char *target);
+
+    /**
+     * Create a regular file with the data written by the given
+     * function.  The file appears only after all data has been
+     * written, so a failure in the middle does not leave a
+     * truncated file behind.
+     */
+    void WriteFile(std::string_view name, mode_t mode,
+                   std::function<void(FileWriter &)> write);
+
+  private:
+    /**
+     * Open the parent directory of the given member, creating
+     * missing directories.  Symlinks are never followed.
+     *
+     * @return the parent directory and the base name
+     */
+    std::pair<FileDescriptor, std::string> OpenParent(std::string_view name);
+};
+
+std::pair<FileDescriptor, std::string>
+ArchiveWriter::OpenParent(std::string_view name) {
+    const auto slash = name.rfind('/');
+    if (slash == name.npos)
+        return {root, std::string{name}};
+
+    const auto parent = name.substr(0, slash);
+    std::string base{name.substr(slash + 1)};
+
+    if (parent_fd.IsDefined() && parent == parent_path)
+        return {parent_fd, std::move(base)};
+
+    parent_fd.Close();
+    parent_path.clear();
+
+    UniqueFileDescriptor fd;
+    FileDescriptor current = root;
+
+    for (std::string_view rest = parent; !rest.empty();) {
+        const auto i = rest.find('/');
+        const std::string segment{rest.substr(0, i)};
+        rest = i == rest.npos ? std::string_view{} : rest.substr(i + 1);
+
+        if (mkdirat(current.Get(), segment.c_str(), 0777) < 0 &&
+            errno != EEXIST)
+            throw FmtErrno("Failed to create directory {}", segment);
+
+        UniqueFileDescriptor next;
+        if (!next.Open(current, segment.c_str(),
+                       O_PATH | O_DIRECTORY | O_NOFOLLOW))
+            throw FmtErrno("Failed to open directory {}", segment);
+
+        fd = std::move(next);
+        current = fd;
+    }
+
+    parent_fd = std::move(fd);
+    parent_path = parent;
+    return {parent_fd, std::move(base)};
+}
+
+void ArchiveWriter::MakeDirectory(std::string_view name, mode_t mode) {
+    const auto [parent, base] = OpenParent(name);
+    if (mkdirat(parent.Get(), base.c_str(), mode) < 0 && errno != EEXIST)
+        throw FmtErrno("Failed to create directory {}", name);
+}
+
+void ArchiveWriter::MakeSymlink(std::string_view name, const char *target) {
+    const auto [parent, base] = OpenParent(name);
+
+    if (unlinkat(parent.Get(), base.c_str(), 0) < 0 && errno != ENOENT)
+        throw FmtErrno("Failed to delete {}", name);
+
+    if (symlinkat(target, parent.Get(), base.c_str()) < 0)
+        throw FmtErrno("Failed to create symlink {}", name);
+}
+
+void ArchiveWriter::WriteFile(std::string_view name, mode_t mode,
+                              std::function<void(FileWriter &)> write) {
+    const auto [parent, base] = OpenParent(name);
+
+    FileWriter file{parent, base.c_str()};
+    if (fchmod(file.GetFileDescriptor().Get(), mode) < 0)
+        throw FmtErrno("Failed to change mode of {}", name);
+
+    write(file);
+    file.Commit();
+}
+
+/**
+ * Obtains the contents of a template member, reading its raw data
+ * from the #ArchiveReader if needed.  Returns std::nullopt if the
+ * member is not a template.
+ */
+using ArchiveTemplateFunction = std::function<std::optional<std::string_view>(
+    ArchiveReader &reader, const ArchiveMember &member)>;
+
+static void ExtractArchive(PathReference source, PathReference destination,
+                           ArchiveTemplateFunction get_template) {
+    ArchiveReader reader{
+        OpenReadOnly(source.directory_fd, source.relative_path)};
+
+    UniqueFileDescriptor destination_fd;
+    if (!destination_fd.Open(destination.directory_fd,
+                             *destination.relative_path != 0
+                                 ? destination.relative_path
+                                 : ".",
+                             O_PATH | O_DIRECTORY))
+        throw FmtErrno("Failed to open {}", destination.relative_path);
+
+    ArchiveWriter writer{destination_fd};
+
+    ArchiveMember member;
+    while (reader.Next(member)) {
+        const std::string_view name = member.name;
+
+        switch (member.type) {
+        case '0':
+        case '\0':
+        case '7':
+            if (name.empty())
+                throw std::runtime_error{"Empty file name in archive"};
+
+            if (const auto contents = get_template(reader, member)) {
+                writer.WriteFile(name, member.mode,
+                                 [&contents](FileWriter &file) {
+                                     file.Write(AsBytes(*contents));
+                                 });
+            } else {
+                writer.WriteFile(name, member.mode, [&](FileWriter &file) {
+                    std::array<std::byte, 65536> buffer;
+                    for (std::size_t rest = member.size; rest > 0;) {
+                        const auto chunk = std::span{buffer}.first(
+                            std::min(rest, buffer.size()));
+                        reader.ReadData(chunk);
+                        file.Write(chunk);
+                        rest -= chunk.size();
+                        metrics.extracted_bytes += chunk.size();
+                    }
+                });
+            }
+
+            ++metrics.files_created;
+            break;
+
+        case '5':
+            if (!name.empty())
+                writer.MakeDirectory(name, member.mode);
+            break;
+
+        case '2':
+            if (name.empty())
+                throw std::runtime_error{"Empty file name in archive"};
+            writer.MakeSymlink(name, member.link_target.c_str());
+            break;
+
+        default:
+            throw FmtRuntimeError("Unsupported tar member type '{}': {}",
+                                  member.type, name);
+        }
+    }
+}
+
+[[gnu::pure]]
+static bool IsTemplate(const ArchiveMember &member,
+                       const char *template_pattern) noexcept {
+    return template_pattern != nullptr &&
+           fnmatch(template_pattern, member.name.c_str(), 0) == 0;
+}
+
+void ExtractArchive(lua_State *L, PathReference source,
+                    PathReference destination,
+                    const char *template_pattern) {
+    std::string rendered;
+
+    ExtractArchive(source, destination,
+                   [L, template_pattern, &rendered](
+                       ArchiveReader &reader, const ArchiveMember &member)
+                       -> std::optional<std::string_view> {
+                       if (!IsTemplate(member, template_pattern))
+                           return std::nullopt;
+
+                       const auto data = reader.ReadTemplate(member);
+                       rendered.clear();
+                       RunTemplate(L, data, [&rendered](auto s) {
+                           rendered.append(s);
+                       });
+                       return rendered;
+                   });
+}
+
+void ExtractArchive(PathReference source, PathReference destination,
+                    const ArchiveTemplates &templates) {
+    ExtractArchive(source, destination,
+                   [&templates](ArchiveReader &,
+                                const ArchiveMember &member)
+                       -> std::optional<std::string_view> {
+                       if (auto i = templates.find(member.name);
+                           i != templates.end())
+                           return i->second;
+
+                       return std::nullopt;
+                   });
+}
+
+ArchiveTemplates RenderArchiveTemplates(lua_State *L, PathReference source,
+                                        const char *template_pattern) {
+    ArchiveTemplates templates;
+    if (template_pattern == nullptr)
+        return templates;
+
+    ArchiveReader reader{
+        OpenReadOnly(source.directory_fd, source.relative_path)};
+
+    ArchiveMember member;
+    while (reader.Next(member)) {
+        if ((member.type != '0' && member.type != '\0' &&
+             member.type != '7') ||
+            !IsTemplate(member, template_pattern))
+            continue;
+
+        const auto data = reader.ReadTemplate(member);
+
+        std::string rendered;
+        RunTemplate(L, data,
+                    [&rendered](auto s) { rendered.append(s); });
+
+        /* a later member with the same name replaces the earlier
+           one */
+        templates.insert_or_assign(std::move(member.name),
+                                   std::move(rendered));
+    }
+
+    return templates;
+}
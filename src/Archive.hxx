@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+
+struct lua_State;
+struct PathReference;
+
+/**
+ * Rendered template members of an archive, indexed by their
+ * (normalized) member name.
+ */
+using ArchiveTemplates = std::map<std::string, std::string, std::less<>>;
+
+/**
+ * Extract a tar archive (optionally zstd-compressed, which is
+ * auto-detected) into the given directory.  The archive is read
+ * sequentially; all files are created relative to the destination
+ * directory, and symlinks inside the destination are never
+ * followed.
+ *
+ * Throws on error.
+ *
+ * @param template_pattern if not nullptr, then regular files whose
+ * name matches this fnmatch() pattern are rendered with
+ * RunTemplate()
+ */
+void ExtractArchive(lua_State *L, PathReference source,
+                    PathReference destination,
+                    const char *template_pattern);
+
+/**
+ * Like ExtractArchive(), but take the contents of template members
+ * from the given map (rendered earlier by RenderArchiveTemplates()).
+ * This does not need the Lua state.
+ */
+void ExtractArchive(PathReference source, PathReference destination,
+                    const ArchiveTemplates &templates);
+
+/**
+ * Read the archive and render all regular files whose name matches
+ * the given fnmatch() pattern, without extracting anything.
+ *
+ * Throws on error.
+ */
+ArchiveTemplates RenderArchiveTemplates(lua_State *L, PathReference source,
+                                        const char *template_pattern);
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Async.hxx"
+#include "lua/Class.hxx"
+#include "lua/Error.hxx"
+#include "lua/Util.hxx"
+
+extern "C" {
+#include <lauxlib.h>
+}
+
+#include <stdexcept>
+
+class Future {
+    std::shared_ptr<TrackedTask> task;
+
+  public:
+    explicit Future(std::shared_ptr<TrackedTask> &&_task) noexcept
+        : task(std::move(_task)) {}
+
+    /**
+     * Wait for the operation to finish and push its result (or
+     * nil).  Throws if the operation has failed.
+     */
+    void Await(lua_State *L);
+
+    static int l_await(lua_State *L);
+};
+
+static constexpr char lua_future_class[] = "Future";
+using LuaFuture = Lua::Class<Future, lua_future_class>;
+
+void Future::Await(lua_State *L) {
+    if (task->awaited)
+        throw std::logic_error{"Future has already been awaited"};
+
+    task->awaited = true;
+    const auto result = task->future.get();
+    if (result)
+        Lua::Push(L, *result);
+    else
+        lua_pushnil(L);
+}
+
+/**
+ * Lua: future:await()
+ */
+int Future::l_await(lua_State *L) try {
+    if (lua_gettop(L) != 1)
+        return luaL_error(L, "Invalid parameters");
+
+    LuaFuture::Cast(L, 1).Await(L);
+    return 1;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+/**
+ * Lua: await(future1, future2, ...)
+ *
+ * Waits for all futures and returns their results.
+ */
+static int l_await(lua_State *L) try {
+    const int n = lua_gettop(L);
+    if (n < 1)
+        return luaL_error(L, "Invalid parameter count");
+
+    for (int i = 1; i <= n; ++i)
+        if (LuaFuture::Check(L, i) == nullptr)
+            luaL_argerror(L, i, "Future expected");
+
+    luaL_checkstack(L, n, nullptr);
+
+    for (int i = 1; i <= n; ++i)
+        LuaFuture::Cast(L, i).Await(L);
+
+    return n;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+void RegisterLuaAsync(lua_State *L) noexcept {
+    using namespace Lua;
+
+    LuaFuture::Register(L);
+    lua_newtable(L);
+    SetTable(L, RelativeStackIndex{-1}, "await", Future::l_await);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    SetGlobal(L, "await", l_await);
+}
+
+void NewLuaFuture(lua_State *L, WorkerPool &pool,
+                  std::future<AsyncResult> &&future) {
+    LuaFuture::New(L, pool.Track(std::move(future)));
+}
+
+void NewLuaReadyFuture(lua_State *L) {
+    std::promise<AsyncResult> promise;
+    promise.set_value(std::nullopt);
+    LuaFuture::New(L, std::make_shared<TrackedTask>(promise.get_future()));
+}
+
+WorkerPool &GetLuaWorkerPool(lua_State *L, int upvalue) {
+    return *static_cast<WorkerPool *>(
+        lua_touserdata(L, lua_upvalueindex(upvalue)));
+}
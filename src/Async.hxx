@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "WorkerPool.hxx"
+
+struct lua_State;
+
+/**
+ * Register the "Future" class and the await() function.
+ */
+void RegisterLuaAsync(lua_State *L) noexcept;
+
+/**
+ * Push a new "Future" object which refers to the given
+ * std::future.  It is tracked by the #WorkerPool, so its error is
+ * not lost if the script never awaits it.
+ */
+void NewLuaFuture(lua_State *L, WorkerPool &pool,
+                  std::future<AsyncResult> &&future);
+
+/**
+ * Push a new "Future" object which is already finished (without a
+ * value).
+ */
+void NewLuaReadyFuture(lua_State *L);
+
+/**
+ * Obtain the #WorkerPool from the given upvalue of the running C
+ * closure.
+ */
+WorkerPool &GetLuaWorkerPool(lua_State *L, int upvalue);
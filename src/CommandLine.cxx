@@ -3,12 +3,66 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "CommandLine.hxx"
+#include "config.h"
+#include "util/StringAPI.hxx"
+
+static constexpr const char *usage =
+    "Usage: cm4all-commence [--plan] [--metrics-file FILE]"
+#ifdef HAVE_JSON
+    " [--dry-run]"
+#endif
+#ifdef HAVE_XXHASH
+    " [--manifest MANIFEST]"
+#endif
+    " SCRIPT_PATH DESTINATION_PATH [ARGS.json]"
+#ifdef HAVE_XXHASH
+    "\n       cm4all-commence --verify MANIFEST DIRECTORY"
+#endif
+    ;
 
 CommandLine ParseCommandLine(int argc, char **argv) {
+    CommandLine cmdline;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; ++i) {
+        if (StringIsEqual(argv[i], "--plan"))
+            cmdline.plan = true;
+        else if (StringIsEqual(argv[i], "--metrics-file") && i + 1 < argc)
+            cmdline.metrics_path = argv[++i];
+#ifdef HAVE_JSON
+        else if (StringIsEqual(argv[i], "--dry-run"))
+            cmdline.plan = cmdline.dry_run = true;
+#endif
+#ifdef HAVE_XXHASH
+        else if (StringIsEqual(argv[i], "--manifest") && i + 1 < argc)
+            cmdline.manifest_path = argv[++i];
+        else if (StringIsEqual(argv[i], "--verify") && i + 1 < argc)
+            cmdline.verify_manifest_path = argv[++i];
+#endif
+        else
+            throw usage;
+    }
+
+    argc -= i - 1;
+    argv += i - 1;
+
+    if (cmdline.verify_manifest_path != nullptr) {
+        if (argc != 2 || cmdline.plan || cmdline.manifest_path != nullptr ||
+            cmdline.metrics_path != nullptr)
+            throw usage;
+
+        cmdline.destination_path = argv[1];
+        return cmdline;
+    }
+
     if (argc < 3 || argc > 4)
-        throw "Usage: cm4all-commence SCRIPT_PATH DESTINATION_PATH [ARGS.json]";
+        throw usage;
+
+    /* a dry run does not touch the filesystem, so there is nothing
+       to write a manifest of */
+    if (cmdline.dry_run && cmdline.manifest_path != nullptr)
+        throw usage;
 
-    CommandLine cmdline;
     cmdline.script_path = argv[1];
     cmdline.destination_path = argv[2];
     if (argc > 3)
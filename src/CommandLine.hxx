@@ -12,6 +12,37 @@ struct CommandLine {
     const char *destination_path = nullptr;
 
     const char *args_json_path = nullptr;
+
+    /**
+     * Record filesystem operations in a #Plan and execute them
+     * after the script has finished?
+     */
+    bool plan = false;
+
+    /**
+     * Dump the optimized #Plan as JSON to stdout instead of
+     * executing it (implies #plan).  The destination directory is
+     * not touched.
+     */
+    bool dry_run = false;
+
+    /**
+     * If set, then write a manifest of the destination directory to
+     * this file after the script has finished.
+     */
+    const char *manifest_path = nullptr;
+
+    /**
+     * If set, then no script is run; instead, the
+     * #destination_path is verified against this manifest file.
+     */
+    const char *verify_manifest_path = nullptr;
+
+    /**
+     * If set, then write run metrics in the Prometheus text format
+     * to this file at exit.
+     */
+    const char *metrics_path = nullptr;
 };
 
 CommandLine ParseCommandLine(int argc, char **argv);
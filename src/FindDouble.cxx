@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "FindDouble.hxx"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <string.h>
+
+#ifdef __SSE2__
+
+/**
+ * After this many 16-byte windows without any brace, FindDouble()
+ * switches back to memchr().
+ */
+static constexpr unsigned MAX_EMPTY_WINDOWS = 4;
+
+#endif
+
+std::size_t FindDouble(std::string_view s, char c) noexcept {
+    const char *const begin = s.data();
+    const char *p = begin;
+    const char *const end = begin + s.size();
+
+    while (end - p > 1) {
+        /* skip quickly to the next candidate; glibc's memchr() is
+           vectorized and beats the loop below on text without
+           braces */
+        p = static_cast<const char *>(memchr(p, c, end - p - 1));
+        if (p == nullptr)
+            break;
+
+        if (p[1] == c)
+            return p - begin;
+
+#ifdef __SSE2__
+        /* SSE2 is part of the x86_64 baseline, so no runtime
+           dispatch is necessary */
+        const __m128i needle = _mm_set1_epi8(c);
+
+        if (end - p <= 16) {
+            /* too short for SIMD */
+            p += 2;
+            continue;
+        }
+
+        /* the number of consecutive 16-byte windows without any
+           brace */
+        unsigned empty = 0;
+
+        while (end - p > 16) {
+            const __m128i a = _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), needle);
+            const __m128i b = _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1)),
+                needle);
+            const int mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+            if (mask != 0)
+                return p - begin + __builtin_ctz(mask);
+
+            empty = _mm_movemask_epi8(a) != 0 ? 0 : empty + 1;
+            p += 16;
+
+            /* no brace for a while: fall back to memchr() */
+            if (empty >= MAX_EMPTY_WINDOWS)
+                break;
+        }
+#else
+        p += 2;
+#endif
+    }
+
+    return s.npos;
+}
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <string_view>
+
+/**
+ * Find the first occurrence of the character #c repeated twice
+ * (i.e. "{{" or "}}").
+ *
+ * Unlike std::string_view::find(), this does not stop at each single
+ * occurrence of #c: it compares two overlapping 16-byte windows
+ * (offset by one byte) at a time, which makes it fast on input with
+ * many lone braces, e.g. CSS and JavaScript.
+ *
+ * @return the position or std::string_view::npos
+ */
+[[gnu::pure]]
+std::size_t FindDouble(std::string_view s, char c) noexcept;
@@ -3,8 +3,13 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Library.hxx"
+#include "Archive.hxx"
+#include "Async.hxx"
+#include "Metrics.hxx"
 #include "Path.hxx"
+#include "Plan.hxx"
 #include "Template.hxx"
+#include "config.h"
 #include "io/FileWriter.hxx"
 #include "io/MakeDirectory.hxx"
 #include "io/Open.hxx"
@@ -18,13 +23,28 @@
 #include "util/ScopeExit.hxx"
 #include "util/SpanCast.hxx"
 
+#ifdef HAVE_XXHASH
+#include "Manifest.hxx"
+#endif
+
 extern "C" {
 #include <lauxlib.h>
 }
 
+#include <stdexcept>
+
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
+/**
+ * Obtain the #Plan passed to OpenLibrary() or nullptr if operations
+ * shall be executed immediately.
+ */
+static Plan *GetPlan(lua_State *L) noexcept {
+    return static_cast<Plan *>(lua_touserdata(L, lua_upvalueindex(1)));
+}
+
 static int l_make_directory(lua_State *L) {
     if (lua_gettop(L) != 1)
         return luaL_error(L, "Invalid parameter count");
@@ -32,9 +52,16 @@ static int l_make_directory(lua_State *L) {
     const auto path = GetLuaPath(L, 1);
 
     try {
-        NewLuaPathDescriptor(
-            L, MakeNestedDirectory(path.directory_fd, path.relative_path),
-            GetLuaPathString(L, 1));
+        if (auto *plan = GetPlan(L)) {
+            /* the directory will be created when the plan is
+               executed; until then, the returned PathDescriptor
+               refers to it by its path */
+            plan->AddMakeDirectory({path, GetLuaPathString(L, 1)});
+            NewLuaDeferredPathDescriptor(L, path, GetLuaPathString(L, 1));
+        } else
+            NewLuaPathDescriptor(
+                L, MakeNestedDirectory(path.directory_fd, path.relative_path),
+                GetLuaPathString(L, 1));
     } catch (...) {
         Lua::RaiseCurrent(L);
     }
@@ -50,8 +77,17 @@ static int l_recursive_copy(lua_State *L) {
     const auto destination = GetLuaPath(L, 2);
 
     try {
-        RecursiveCopy(source.directory_fd, source.relative_path,
-                      destination.directory_fd, destination.relative_path);
+        if (auto *plan = GetPlan(L))
+            plan->AddRecursiveCopy({source, GetLuaPathString(L, 1)},
+                                   {destination, GetLuaPathString(L, 2)});
+        else {
+            CountCopiedTree(source.directory_fd, source.relative_path);
+
+            const ScopeTimer timer{metrics.recursive_copy};
+            RecursiveCopy(source.directory_fd, source.relative_path,
+                          destination.directory_fd,
+                          destination.relative_path);
+        }
     } catch (...) {
         Lua::RaiseCurrent(L);
     }
@@ -66,7 +102,14 @@ static int l_recursive_delete(lua_State *L) {
     const auto path = GetLuaPath(L, 1);
 
     try {
-        RecursiveDelete(path.directory_fd, path.relative_path);
+        if (auto *plan = GetPlan(L))
+            plan->AddRecursiveDelete({path, GetLuaPathString(L, 1)});
+        else {
+            CountDeletedTree(path.directory_fd, path.relative_path);
+
+            const ScopeTimer timer{metrics.recursive_delete};
+            RecursiveDelete(path.directory_fd, path.relative_path);
+        }
     } catch (...) {
         Lua::RaiseCurrent(L);
     }
@@ -74,13 +117,12 @@ static int l_recursive_delete(lua_State *L) {
     return 0;
 }
 
-static int l_copy_template(lua_State *L) try {
-    if (lua_gettop(L) != 2)
-        return luaL_error(L, "Invalid parameter count");
-
-    const auto source = GetLuaPath(L, 1);
-    const auto destination = GetLuaPath(L, 2);
-
+/**
+ * Load a template file and render it, passing the output to the
+ * given callback.
+ */
+static void RunTemplateFile(lua_State *L, PathReference source,
+                            TemplateWriteCallback callback) {
     const auto source_fd =
         OpenReadOnly(source.directory_fd, source.relative_path);
 
@@ -102,20 +144,297 @@ static int l_copy_template(lua_State *L) try {
 
     madvise(source_data, source_size, MADV_WILLNEED);
 
+    RunTemplate(L, {source_data, source_size}, std::move(callback));
+}
+
+/**
+ * Render a template file into a std::string.
+ */
+static std::string RenderTemplateFile(lua_State *L, PathReference source) {
+    std::string contents;
+    RunTemplateFile(L, source, [&contents](auto s) { contents.append(s); });
+    return contents;
+}
+
+static int l_copy_template(lua_State *L) try {
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto source = GetLuaPath(L, 1);
+    const auto destination = GetLuaPath(L, 2);
+
+    if (auto *plan = GetPlan(L)) {
+        /* the template must be rendered now because it refers to
+           the current state of the Lua globals */
+        plan->CheckUnmodified({source, GetLuaPathString(L, 1)});
+        plan->AddCopyTemplate(RenderTemplateFile(L, source),
+                              {destination, GetLuaPathString(L, 2)});
+        return 0;
+    }
+
+    const ScopeTimer timer{metrics.copy_template};
+
     FileWriter writer{destination.directory_fd, destination.relative_path};
-    RunTemplate(L, {source_data, source_size},
-                [&writer](auto s) { writer.Write(AsBytes(s)); });
+    RunTemplateFile(L, source,
+                    [&writer](auto s) { writer.Write(AsBytes(s)); });
 
     writer.Commit();
+    ++metrics.files_created;
+
+    return 0;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+/**
+ * Lua: extract_archive(src, dst [, {template="*.html"}])
+ */
+static int l_extract_archive(lua_State *L) try {
+    const int top = lua_gettop(L);
+    if (top < 2 || top > 3)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto source = GetLuaPath(L, 1);
+    const auto destination = GetLuaPath(L, 2);
+
+    const char *template_pattern = nullptr;
+    if (top >= 3 && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "template");
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isstring(L, -1))
+                luaL_argerror(L, 3, "string expected for 'template'");
+
+            /* the string stays valid because it is referenced by
+               the options table */
+            template_pattern = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (auto *plan = GetPlan(L)) {
+        /* templates must be rendered now because they refer to
+           the current state of the Lua globals; the archive is
+           read again when the plan is executed */
+        if (template_pattern != nullptr)
+            plan->CheckUnmodified({source, GetLuaPathString(L, 1)});
+
+        plan->AddExtractArchive(
+            {source, GetLuaPathString(L, 1)},
+            {destination, GetLuaPathString(L, 2)},
+            RenderArchiveTemplates(L, source, template_pattern));
+        return 0;
+    }
+
+    const ScopeTimer timer{metrics.extract_archive};
+    ExtractArchive(L, source, destination, template_pattern);
+    return 0;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+static int l_async_recursive_copy(lua_State *L) try {
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto source_ref = GetLuaPath(L, 1);
+    const auto destination_ref = GetLuaPath(L, 2);
+
+    Plan::Path source{source_ref, GetLuaPathString(L, 1)};
+    Plan::Path destination{destination_ref, GetLuaPathString(L, 2)};
+
+    if (auto *plan = GetPlan(L)) {
+        plan->AddRecursiveCopy(std::move(source), std::move(destination));
+        NewLuaReadyFuture(L);
+        return 1;
+    }
+
+    auto &pool = GetLuaWorkerPool(L, 2);
+    NewLuaFuture(L, pool,
+                 pool.Submit([source = std::move(source),
+                              destination = std::move(destination)]() {
+                     CountCopiedTree(source.directory_fd,
+                                     source.relative_path.c_str());
+
+                     const ScopeTimer timer{metrics.recursive_copy};
+                     RecursiveCopy(source.directory_fd,
+                                   source.relative_path.c_str(),
+                                   destination.directory_fd,
+                                   destination.relative_path.c_str());
+                     return AsyncResult{};
+                 }));
+    return 1;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+static int l_async_recursive_delete(lua_State *L) try {
+    if (lua_gettop(L) != 1)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto path_ref = GetLuaPath(L, 1);
+    Plan::Path path{path_ref, GetLuaPathString(L, 1)};
+
+    if (auto *plan = GetPlan(L)) {
+        plan->AddRecursiveDelete(std::move(path));
+        NewLuaReadyFuture(L);
+        return 1;
+    }
+
+    auto &pool = GetLuaWorkerPool(L, 2);
+    NewLuaFuture(L, pool, pool.Submit([path = std::move(path)]() {
+        CountDeletedTree(path.directory_fd, path.relative_path.c_str());
+
+        const ScopeTimer timer{metrics.recursive_delete};
+        RecursiveDelete(path.directory_fd, path.relative_path.c_str());
+        return AsyncResult{};
+    }));
+    return 1;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+/**
+ * Like copy_template(), but only the template is rendered
+ * synchronously (because that needs the Lua state); writing the
+ * file is done by a worker thread.
+ */
+static int l_async_copy_template(lua_State *L) try {
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto source = GetLuaPath(L, 1);
+    const auto destination_ref = GetLuaPath(L, 2);
+
+    if (auto *plan = GetPlan(L))
+        plan->CheckUnmodified({source, GetLuaPathString(L, 1)});
+
+    auto contents = RenderTemplateFile(L, source);
+    Plan::Path destination{destination_ref, GetLuaPathString(L, 2)};
+
+    if (auto *plan = GetPlan(L)) {
+        plan->AddCopyTemplate(std::move(contents), std::move(destination));
+        NewLuaReadyFuture(L);
+        return 1;
+    }
+
+    auto &pool = GetLuaWorkerPool(L, 2);
+    NewLuaFuture(L, pool,
+                 pool.Submit([contents = std::move(contents),
+                              destination = std::move(destination)]() {
+                     const ScopeTimer timer{metrics.copy_template};
+                     FileWriter writer{destination.directory_fd,
+                                       destination.relative_path.c_str()};
+                     writer.Write(AsBytes(std::string_view{contents}));
+                     writer.Commit();
+                     ++metrics.files_created;
+                     return AsyncResult{};
+                 }));
+    return 1;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+#ifdef HAVE_XXHASH
+
+/**
+ * Prepare for reading the given directory: fail in plan mode
+ * (because the plan has not been executed yet) and wait for
+ * async_*() builtins which may still be writing to it.  This is
+ * what the "--manifest" command-line option does, too.
+ */
+static void PrepareManifest(lua_State *L) {
+    if (GetPlan(L) != nullptr)
+        throw std::runtime_error{"Manifests are not supported in plan mode"};
+
+    GetLuaWorkerPool(L, 2).WaitIdle();
+}
+
+/**
+ * Open the given path as a directory.
+ */
+static UniqueFileDescriptor OpenDirectory(PathReference path) {
+    return OpenPath(path.directory_fd,
+                    *path.relative_path != 0 ? path.relative_path : ".",
+                    O_DIRECTORY);
+}
 
+/**
+ * Lua: write_manifest(dir, manifest_file)
+ */
+static int l_write_manifest(lua_State *L) try {
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto directory = GetLuaPath(L, 1);
+    const auto manifest_path = GetLuaPath(L, 2);
+
+    PrepareManifest(L);
+    WriteManifest(manifest_path, BuildManifest(OpenDirectory(directory),
+                                               GetLuaWorkerPool(L, 2)));
     return 0;
 } catch (...) {
     Lua::RaiseCurrent(L);
 }
 
-void OpenLibrary(lua_State *L) noexcept {
-    Lua::SetGlobal(L, "make_directory", l_make_directory);
-    Lua::SetGlobal(L, "recursive_copy", l_recursive_copy);
-    Lua::SetGlobal(L, "recursive_delete", l_recursive_delete);
-    Lua::SetGlobal(L, "copy_template", l_copy_template);
+/**
+ * Lua: verify_manifest(dir, manifest_file)
+ *
+ * Returns a table of differences (empty if the directory matches the
+ * manifest).
+ */
+static int l_verify_manifest(lua_State *L) try {
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "Invalid parameter count");
+
+    const auto directory = GetLuaPath(L, 1);
+    const auto manifest_path = GetLuaPath(L, 2);
+
+    PrepareManifest(L);
+    const auto differences = CompareManifest(
+        LoadManifest(manifest_path),
+        BuildManifest(OpenDirectory(directory), GetLuaWorkerPool(L, 2)));
+
+    lua_createtable(L, differences.size(), 0);
+    for (std::size_t i = 0; i < differences.size(); ++i) {
+        Lua::Push(L, differences[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+} catch (...) {
+    Lua::RaiseCurrent(L);
+}
+
+#endif // HAVE_XXHASH
+
+static void SetGlobalClosure(lua_State *L, const char *name,
+                             lua_CFunction fn, Plan *plan,
+                             WorkerPool &pool) noexcept {
+    lua_pushlightuserdata(L, plan);
+    lua_pushlightuserdata(L, &pool);
+    lua_pushcclosure(L, fn, 2);
+    lua_setglobal(L, name);
+}
+
+void OpenLibrary(lua_State *L, Plan *plan, WorkerPool &pool) noexcept {
+    SetGlobalClosure(L, "make_directory", l_make_directory, plan, pool);
+    SetGlobalClosure(L, "recursive_copy", l_recursive_copy, plan, pool);
+    SetGlobalClosure(L, "recursive_delete", l_recursive_delete, plan, pool);
+    SetGlobalClosure(L, "copy_template", l_copy_template, plan, pool);
+
+    SetGlobalClosure(L, "extract_archive", l_extract_archive, plan, pool);
+
+    SetGlobalClosure(L, "async_recursive_copy", l_async_recursive_copy, plan,
+                     pool);
+    SetGlobalClosure(L, "async_recursive_delete", l_async_recursive_delete,
+                     plan, pool);
+    SetGlobalClosure(L, "async_copy_template", l_async_copy_template, plan,
+                     pool);
+
+#ifdef HAVE_XXHASH
+    SetGlobalClosure(L, "write_manifest", l_write_manifest, plan, pool);
+    SetGlobalClosure(L, "verify_manifest", l_verify_manifest, plan, pool);
+#endif
 }
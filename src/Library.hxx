@@ -5,5 +5,14 @@
 #pragma once
 
 struct lua_State;
+class Plan;
+class WorkerPool;
 
-void OpenLibrary(lua_State *L) noexcept;
+/**
+ * Register the filesystem builtins.
+ *
+ * @param plan if not nullptr, then the builtins record operations
+ * in this #Plan instead of executing them
+ * @param pool the #WorkerPool which runs the async_*() builtins
+ */
+void OpenLibrary(lua_State *L, Plan *plan, WorkerPool &pool) noexcept;
@@ -2,9 +2,12 @@
 // Copyright CM4all GmbH
 // author: Max Kellermann <max.kellermann@ionos.com>
 
+#include "Async.hxx"
 #include "CommandLine.hxx"
 #include "Library.hxx"
+#include "Metrics.hxx"
 #include "Path.hxx"
+#include "Plan.hxx"
 #include "Random.hxx"
 #include "config.h"
 #include "io/MakeDirectory.hxx"
@@ -13,6 +16,12 @@
 
 #ifdef HAVE_SODIUM
 #include "PwHash.hxx"
+
+#include <sodium/core.h>
+#endif
+
+#ifdef HAVE_XXHASH
+#include "Manifest.hxx"
 #endif
 
 #ifdef HAVE_JSON
@@ -29,6 +38,7 @@
 #include "lua/Util.hxx"
 #include "system/Error.hxx"
 #include "util/PrintException.hxx"
+#include "util/ScopeExit.hxx"
 #include "util/SpanCast.hxx"
 #include "util/StringAPI.hxx"
 
@@ -41,10 +51,13 @@ extern "C" {
 #include <lualib.h>
 }
 
+#include <stdexcept>
+
 #include <fcntl.h> // for AT_FDCWD
+#include <stdio.h>
 #include <stdlib.h>
 
-static void SetupLuaState(lua_State *L) {
+static void SetupLuaState(lua_State *L, Plan *plan, WorkerPool &pool) {
     luaL_openlibs(L);
 #ifdef HAVE_JSON
     Lua::InitToJson(L);
@@ -54,10 +67,11 @@ static void SetupLuaState(lua_State *L) {
 #endif
     RegisterLuaPath(L);
     RegisterLuaRandom(L);
+    RegisterLuaAsync(L);
 #ifdef HAVE_SODIUM
-    Lua::RegisterPwHash(L);
+    Lua::RegisterPwHash(L, pool);
 #endif
-    OpenLibrary(L);
+    OpenLibrary(L, plan, pool);
 }
 
 static std::string GetParentPath(std::string_view path) noexcept {
@@ -98,7 +112,8 @@ static nlohmann::json LoadJsonFile(const char *path) {
 
 #endif // HAVE_JSON
 
-static void SetGlobals(lua_State *L, const CommandLine &cmdline) {
+static void SetGlobals(lua_State *L, const CommandLine &cmdline,
+                       Plan *plan) {
     const Lua::ScopeCheckStack check_stack{L};
 
     const auto src = GetParentPath(cmdline.script_path);
@@ -106,9 +121,19 @@ static void SetGlobals(lua_State *L, const CommandLine &cmdline) {
     Lua::SetGlobal(L, "src", Lua::RelativeStackIndex{-1});
     lua_pop(L, 1);
 
-    NewLuaPathDescriptor(
-        L, MakeDirectory(FileDescriptor{AT_FDCWD}, cmdline.destination_path),
-        cmdline.destination_path);
+    const PathReference destination{FileDescriptor{AT_FDCWD},
+                                    cmdline.destination_path};
+    if (plan != nullptr) {
+        /* in plan mode, the destination directory is created
+           when the plan is executed (i.e. never in a dry run) */
+        plan->AddMakeDirectory({destination, cmdline.destination_path});
+        NewLuaDeferredPathDescriptor(L, destination,
+                                     cmdline.destination_path);
+    } else
+        NewLuaPathDescriptor(L,
+                             MakeDirectory(destination.directory_fd,
+                                           destination.relative_path),
+                             cmdline.destination_path);
     Lua::SetGlobal(L, "path", Lua::RelativeStackIndex{-1});
     lua_pop(L, 1);
 
@@ -119,16 +144,119 @@ static void SetGlobals(lua_State *L, const CommandLine &cmdline) {
 }
 
 static int Run(const CommandLine &cmdline) {
+#ifdef HAVE_SODIUM
+    /* libsodium is thread-safe only after sodium_init(), and
+       async_pwhash() calls it from worker threads */
+    if (sodium_init() < 0)
+        throw std::runtime_error{"sodium_init() failed"};
+#endif
+
+    Plan plan;
+
+    /* must outlive the Lua state which refers to it; its
+       destructor waits for tasks which have not been awaited */
+    WorkerPool pool{std::thread::hardware_concurrency()};
+
     const Lua::State lua_state{luaL_newstate()};
-    SetupLuaState(lua_state.get());
-    SetGlobals(lua_state.get(), cmdline);
+    SetupLuaState(lua_state.get(), cmdline.plan ? &plan : nullptr, pool);
+    SetGlobals(lua_state.get(), cmdline, cmdline.plan ? &plan : nullptr);
+
+    {
+        const auto start = std::chrono::steady_clock::now();
+        AtScopeExit(start) {
+            metrics.lua_duration = std::chrono::steady_clock::now() - start;
+        };
+
+        Lua::RunFile(lua_state.get(), cmdline.script_path);
+    }
+
+    if (cmdline.plan) {
+        plan.Optimize();
+
+#ifdef HAVE_JSON
+        if (cmdline.dry_run) {
+            puts(plan.ToJson().dump(2).c_str());
+            return EXIT_SUCCESS;
+        }
+#endif
+
+        plan.Execute();
+    }
+
+    /* fail if an async_*() builtin has failed, even if the script
+       has not awaited it */
+    pool.RethrowUnawaited();
+
+#ifdef HAVE_XXHASH
+    if (cmdline.manifest_path != nullptr) {
+        /* include files written by async_*() builtins which were
+           not awaited */
+        pool.WaitIdle();
+
+        WriteManifest({FileDescriptor{AT_FDCWD}, cmdline.manifest_path},
+                      BuildManifest(OpenPath(cmdline.destination_path,
+                                             O_DIRECTORY),
+                                    pool));
+    }
+#endif
 
-    Lua::RunFile(lua_state.get(), cmdline.script_path);
     return EXIT_SUCCESS;
 }
 
+#ifdef HAVE_XXHASH
+
+static int Verify(const CommandLine &cmdline) {
+    WorkerPool pool{std::thread::hardware_concurrency()};
+
+    const auto differences = CompareManifest(
+        LoadManifest({FileDescriptor{AT_FDCWD}, cmdline.verify_manifest_path}),
+        BuildManifest(OpenPath(cmdline.destination_path, O_DIRECTORY), pool));
+
+    for (const auto &i : differences)
+        puts(i.c_str());
+
+    return differences.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // HAVE_XXHASH
+
+/**
+ * Like Run(), but also write the metrics file (even if Run() has
+ * failed).
+ */
+static int RunWithMetrics(const CommandLine &cmdline) noexcept {
+    metrics.enabled = true;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    int status;
+    try {
+        status = Run(cmdline);
+    } catch (...) {
+        PrintException(std::current_exception());
+        status = EXIT_FAILURE;
+    }
+
+    metrics.run_duration = std::chrono::steady_clock::now() - start;
+
+    try {
+        WriteMetrics(cmdline.metrics_path, status == EXIT_SUCCESS);
+    } catch (...) {
+        PrintException(std::current_exception());
+        status = EXIT_FAILURE;
+    }
+
+    return status;
+}
+
 int main(int argc, char **argv) noexcept try {
     const auto cmdline = ParseCommandLine(argc, argv);
+#ifdef HAVE_XXHASH
+    if (cmdline.verify_manifest_path != nullptr)
+        return Verify(cmdline);
+#endif
+    if (cmdline.metrics_path != nullptr)
+        return RunWithMetrics(cmdline);
     return Run(cmdline);
 } catch (...) {
     PrintException(std::current_exception());
@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Manifest.hxx"
+#include "Path.hxx"
+#include "WorkerPool.hxx"
+#include "io/FileWriter.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "util/SpanCast.hxx"
+
+#include <fmt/core.h>
+
+#include <xxhash.h>
+
+#include <algorithm>
+#include <array>
+#include <future>
+#include <memory>
+#include <new> // for std::bad_alloc
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * The number of files hashed by one worker task.
+ */
+static constexpr std::size_t HASH_BATCH_SIZE = 64;
+
+static std::string FormatHash(XXH128_hash_t hash) {
+    return fmt::format("{:016x}{:016x}", hash.high64, hash.low64);
+}
+
+struct XXH3StateDeleter {
+    void operator()(XXH3_state_t *state) const noexcept {
+        XXH3_freeState(state);
+    }
+};
+
+/**
+ * Hash the contents of a regular file.  The file is read with
+ * read() instead of being mapped into memory, because another
+ * process may truncate it while we're hashing; with mmap(), that
+ * would raise SIGBUS, but read() merely returns less data, and the
+ * resulting hash mismatch is reported as drift.
+ */
+static std::string HashFile(FileDescriptor directory, const char *path) {
+    const auto fd = OpenReadOnly(directory, path);
+
+    posix_fadvise(fd.Get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const std::unique_ptr<XXH3_state_t, XXH3StateDeleter> state{
+        XXH3_createState()};
+    if (!state)
+        throw std::bad_alloc{};
+
+    XXH3_128bits_reset(state.get());
+
+    while (true) {
+        std::array<std::byte, 65536> buffer;
+        auto nbytes = fd.Read(buffer);
+        if (nbytes < 0)
+            throw FmtErrno("Failed to read {}", path);
+        if (nbytes == 0)
+            break;
+        XXH3_128bits_update(state.get(), buffer.data(), nbytes);
+    }
+
+    return FormatHash(XXH3_128bits_digest(state.get()));
+}
+
+static std::string HashSymlink(FileDescriptor directory, const char *path,
+                               std::size_t size) {
+    std::string target(size + 1, '\0');
+    const auto nbytes =
+        readlinkat(directory.Get(), path, target.data(), target.size());
+    if (nbytes < 0)
+        throw FmtErrno("Failed to read symlink {}", path);
+
+    return FormatHash(XXH3_128bits(target.data(), nbytes));
+}
+
+struct DirDeleter {
+    void operator()(DIR *dir) const noexcept { closedir(dir); }
+};
+
+/**
+ * Collect all entries below the given directory (recursively).
+ * Regular files are collected without a hash; it is calculated
+ * later in parallel.
+ */
+static void WalkDirectory(FileDescriptor root, const std::string &prefix,
+                          Manifest &manifest) {
+    const int fd =
+        openat(root.Get(), prefix.empty() ? "." : prefix.c_str(),
+               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        throw FmtErrno("Failed to open directory {}", prefix);
+
+    const std::unique_ptr<DIR, DirDeleter> dir{fdopendir(fd)};
+    if (!dir) {
+        close(fd);
+        throw FmtErrno("Failed to open directory {}", prefix);
+    }
+
+    while (const auto *e = readdir(dir.get())) {
+        const std::string_view name = e->d_name;
+        if (name == "."sv || name == ".."sv)
+            continue;
+
+        if (name.find('\n') != name.npos)
+            throw FmtRuntimeError("Newline in file name: {}/{}", prefix,
+                                  name);
+
+        std::string path = prefix.empty() ? std::string{name}
+                                          : prefix + "/" + std::string{name};
+
+        struct stat st;
+        if (fstatat(dirfd(dir.get()), e->d_name, &st, AT_SYMLINK_NOFOLLOW) <
+            0)
+            throw FmtErrno("Failed to stat {}", path);
+
+        ManifestEntry entry{path, st.st_mode,
+                            static_cast<uint_least64_t>(st.st_size), {}};
+
+        if (S_ISDIR(st.st_mode)) {
+            entry.size = 0;
+            entry.hash = "-";
+            manifest.emplace_back(std::move(entry));
+            WalkDirectory(root, path, manifest);
+        } else if (S_ISLNK(st.st_mode)) {
+            entry.hash = HashSymlink(root, path.c_str(), st.st_size);
+            manifest.emplace_back(std::move(entry));
+        } else if (S_ISREG(st.st_mode)) {
+            manifest.emplace_back(std::move(entry));
+        } else {
+            /* special files have no content */
+            entry.size = 0;
+            entry.hash = "-";
+            manifest.emplace_back(std::move(entry));
+        }
+    }
+}
+
+Manifest BuildManifest(FileDescriptor directory, WorkerPool &pool) {
+    Manifest manifest;
+    WalkDirectory(directory, {}, manifest);
+
+    std::sort(manifest.begin(), manifest.end(),
+              [](const ManifestEntry &a, const ManifestEntry &b) {
+                  return a.path < b.path;
+              });
+
+    /* each task fills the hash of a distinct range of regular
+       files, so no locking is needed */
+    std::vector<std::future<AsyncResult>> futures;
+    for (std::size_t i = 0; i < manifest.size();) {
+        const std::size_t begin = i;
+        std::size_t n = 0;
+        for (; i < manifest.size() && n < HASH_BATCH_SIZE; ++i)
+            if (S_ISREG(manifest[i].mode))
+                ++n;
+
+        if (n == 0)
+            continue;
+
+        futures.emplace_back(pool.Submit(
+            [directory, &manifest, begin, end = i]() {
+                for (std::size_t j = begin; j < end; ++j) {
+                    auto &entry = manifest[j];
+                    if (S_ISREG(entry.mode))
+                        entry.hash =
+                            HashFile(directory, entry.path.c_str());
+                }
+
+                return AsyncResult{};
+            }));
+    }
+
+    /* wait for all tasks before rethrowing the first error, because
+       the others still refer to the manifest */
+    std::exception_ptr error;
+    for (auto &i : futures) {
+        try {
+            i.get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    return manifest;
+}
+
+void WriteManifest(PathReference path, const Manifest &manifest) {
+    FileWriter writer{path.directory_fd, path.relative_path};
+
+    std::string line;
+    for (const auto &i : manifest) {
+        line = fmt::format("{} {:o} {} {}\n", i.hash, i.mode, i.size,
+                           i.path);
+        writer.Write(AsBytes(std::string_view{line}));
+    }
+
+    writer.Commit();
+}
+
+static ManifestEntry ParseManifestLine(std::string_view line) {
+    const auto NextField = [&line]() {
+        const auto space = line.find(' ');
+        if (space == line.npos)
+            throw std::runtime_error{"Malformed manifest line"};
+
+        const auto field = std::string{line.substr(0, space)};
+        line = line.substr(space + 1);
+        return field;
+    };
+
+    ManifestEntry entry;
+    entry.hash = NextField();
+
+    const auto mode = NextField();
+    const auto size = NextField();
+
+    char *endptr;
+    entry.mode = strtoul(mode.c_str(), &endptr, 8);
+    if (endptr == mode.c_str() || *endptr != 0)
+        throw std::runtime_error{"Malformed mode in manifest"};
+
+    entry.size = strtoull(size.c_str(), &endptr, 10);
+    if (endptr == size.c_str() || *endptr != 0)
+        throw std::runtime_error{"Malformed size in manifest"};
+
+    if (line.empty())
+        throw std::runtime_error{"Malformed manifest line"};
+
+    entry.path = line;
+    return entry;
+}
+
+Manifest LoadManifest(PathReference path) {
+    const auto fd = OpenReadOnly(path.directory_fd, path.relative_path);
+
+    std::string contents;
+    while (true) {
+        std::array<std::byte, 65536> buffer;
+        auto nbytes = fd.Read(buffer);
+        if (nbytes < 0)
+            throw FmtErrno("Failed to read {}", path.relative_path);
+        if (nbytes == 0)
+            break;
+        contents.append(
+            ToStringView(std::span<const std::byte>{buffer}.first(nbytes)));
+    }
+
+    Manifest manifest;
+
+    std::string_view rest = contents;
+    while (!rest.empty()) {
+        const auto newline = rest.find('\n');
+        const auto line = rest.substr(0, newline);
+        rest = newline == rest.npos ? std::string_view{}
+                                    : rest.substr(newline + 1);
+
+        if (!line.empty())
+            manifest.emplace_back(ParseManifestLine(line));
+    }
+
+    std::sort(manifest.begin(), manifest.end(),
+              [](const ManifestEntry &a, const ManifestEntry &b) {
+                  return a.path < b.path;
+              });
+
+    return manifest;
+}
+
+std::vector<std::string> CompareManifest(const Manifest &expected,
+                                         const Manifest &actual) {
+    std::vector<std::string> differences;
+
+    /* both are sorted by path: merge them */
+    auto e = expected.begin(), a = actual.begin();
+    while (e != expected.end() || a != actual.end()) {
+        if (a == actual.end() || (e != expected.end() && e->path < a->path)) {
+            differences.emplace_back("missing: " + e->path);
+            ++e;
+        } else if (e == expected.end() || a->path < e->path) {
+            differences.emplace_back("added: " + a->path);
+            ++a;
+        } else {
+            if (e->mode != a->mode)
+                differences.emplace_back(fmt::format(
+                    "mode changed ({:o} -> {:o}): {}", e->mode, a->mode,
+                    e->path));
+            else if (e->size != a->size || e->hash != a->hash)
+                differences.emplace_back("modified: " + e->path);
+
+            ++e;
+            ++a;
+        }
+    }
+
+    return differences;
+}
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+struct PathReference;
+class FileDescriptor;
+class WorkerPool;
+
+/**
+ * One file, directory or symlink in a #Manifest.
+ */
+struct ManifestEntry {
+    /**
+     * The path relative to the manifest root.
+     */
+    std::string path;
+
+    /**
+     * The full st_mode (including the file type).
+     */
+    mode_t mode;
+
+    uint_least64_t size;
+
+    /**
+     * The XXH3 128 bit hash of the contents (regular files) or
+     * the link target (symlinks) as hex string; "-" for
+     * directories.
+     */
+    std::string hash;
+};
+
+/**
+ * A list of entries sorted by path.
+ */
+using Manifest = std::vector<ManifestEntry>;
+
+/**
+ * Walk the given directory tree and hash all files.  Hashing is
+ * done in parallel by the #WorkerPool.
+ *
+ * Throws on error.
+ */
+Manifest BuildManifest(FileDescriptor directory, WorkerPool &pool);
+
+/**
+ * Write the manifest to a file, one line per entry:
+ * "HASH MODE SIZE PATH".
+ *
+ * Throws on error.
+ */
+void WriteManifest(PathReference path, const Manifest &manifest);
+
+/**
+ * Load a file which was written by WriteManifest().
+ *
+ * Throws on error.
+ */
+Manifest LoadManifest(PathReference path);
+
+/**
+ * Compare two manifests.
+ *
+ * @return a list of human-readable differences (empty if both are
+ * equal)
+ */
+std::vector<std::string> CompareManifest(const Manifest &expected,
+                                         const Manifest &actual);
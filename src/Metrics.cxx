@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Metrics.hxx"
+#include "io/FileWriter.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/SpanCast.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+
+#include <dirent.h>
+#include <fcntl.h> // for AT_FDCWD
+#include <string.h>
+#include <sys/stat.h>
+
+Metrics metrics;
+
+void Histogram::Observe(std::chrono::steady_clock::duration d) noexcept {
+    const double seconds = std::chrono::duration<double>(d).count();
+    const std::size_t i =
+        std::distance(bounds.begin(), std::lower_bound(bounds.begin(),
+                                                       bounds.end(), seconds));
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+
+    sum_ns.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(),
+        std::memory_order_relaxed);
+}
+
+uint_least64_t Histogram::GetCount() const noexcept {
+    uint_least64_t count = 0;
+    for (const auto &i : buckets)
+        count += i.load(std::memory_order_relaxed);
+    return count;
+}
+
+/**
+ * Add the size and the number of regular files below the given
+ * path to the counters.  Symlinks are not followed.
+ */
+static void CountTree(FileDescriptor directory_fd, const char *path,
+                      uint_least64_t &bytes, uint_least64_t &files) noexcept {
+    struct stat st;
+    if (fstatat(directory_fd.Get(), path, &st,
+                AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+        return;
+
+    if (S_ISREG(st.st_mode)) {
+        bytes += st.st_size;
+        ++files;
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+        return;
+
+    UniqueFileDescriptor fd;
+    if (!fd.Open(directory_fd, *path != 0 ? path : ".",
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW))
+        return;
+
+    DIR *dir = fdopendir(fd.Get());
+    if (dir == nullptr)
+        return;
+
+    /* now owned by the DIR object */
+    const FileDescriptor dir_fd{fd.Steal()};
+
+    while (const auto *e = readdir(dir)) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+
+        CountTree(dir_fd, e->d_name, bytes, files);
+    }
+
+    closedir(dir);
+}
+
+void CountCopiedTree(FileDescriptor directory_fd, const char *path) noexcept {
+    if (!metrics.enabled)
+        return;
+
+    uint_least64_t bytes = 0, files = 0;
+    CountTree(directory_fd, path, bytes, files);
+    metrics.copied_bytes += bytes;
+    metrics.files_created += files;
+}
+
+void CountDeletedTree(FileDescriptor directory_fd, const char *path) noexcept {
+    if (!metrics.enabled)
+        return;
+
+    uint_least64_t bytes = 0, files = 0;
+    CountTree(directory_fd, path, bytes, files);
+    metrics.deleted_bytes += bytes;
+    metrics.deleted_files += files;
+}
+
+static void WriteHeader(std::string &out, const char *name, const char *type,
+                        const char *help) {
+    out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name,
+                       type);
+}
+
+static void WriteGauge(std::string &out, const char *name, const char *help,
+                       double value) {
+    WriteHeader(out, name, "gauge", help);
+    out += fmt::format("{} {}\n", name, value);
+}
+
+static void WriteCounter(std::string &out, const char *name, const char *help,
+                         const std::atomic<uint_least64_t> &value) {
+    WriteHeader(out, name, "counter", help);
+    out += fmt::format("{} {}\n", name,
+                       value.load(std::memory_order_relaxed));
+}
+
+static void WriteHistogram(std::string &out, const char *name,
+                           const char *operation, const Histogram &h) {
+    uint_least64_t cumulative = 0;
+    for (std::size_t i = 0; i < Histogram::bounds.size(); ++i) {
+        cumulative += h.GetBucket(i);
+        out += fmt::format("{}_bucket{{operation=\"{}\",le=\"{}\"}} {}\n",
+                           name, operation, Histogram::bounds[i],
+                           cumulative);
+    }
+
+    const auto count = h.GetCount();
+    out += fmt::format("{}_bucket{{operation=\"{}\",le=\"+Inf\"}} {}\n", name,
+                       operation, count);
+    out += fmt::format("{}_sum{{operation=\"{}\"}} {}\n", name, operation,
+                       h.GetSum());
+    out += fmt::format("{}_count{{operation=\"{}\"}} {}\n", name, operation,
+                       count);
+}
+
+void WriteMetrics(const char *path, bool success) {
+    std::string out;
+
+    WriteGauge(out, "commence_success",
+               "Whether the run was successful (1) or failed (0).",
+               success ? 1 : 0);
+    WriteGauge(out, "commence_run_duration_seconds",
+               "Total wall time of the run.",
+               std::chrono::duration<double>(metrics.run_duration).count());
+    WriteGauge(out, "commence_lua_duration_seconds",
+               "Wall time spent running the Lua script.",
+               std::chrono::duration<double>(metrics.lua_duration).count());
+
+    WriteCounter(out, "commence_rendered_bytes_total",
+                 "Bytes generated by the template engine.",
+                 metrics.rendered_bytes);
+    WriteCounter(out, "commence_extracted_bytes_total",
+                 "Bytes extracted from archives.", metrics.extracted_bytes);
+    WriteCounter(out, "commence_files_created_total",
+                 "Files created by copy_template(), extract_archive() and "
+                 "recursive_copy() (regular files only).",
+                 metrics.files_created);
+    WriteCounter(out, "commence_copied_bytes_total",
+                 "Bytes of regular files copied by recursive_copy().",
+                 metrics.copied_bytes);
+    WriteCounter(out, "commence_deleted_bytes_total",
+                 "Bytes of regular files deleted by recursive_delete().",
+                 metrics.deleted_bytes);
+    WriteCounter(out, "commence_deleted_files_total",
+                 "Regular files deleted by recursive_delete().",
+                 metrics.deleted_files);
+    WriteCounter(out, "commence_random_strings_total",
+                 "Strings generated by Random:make().",
+                 metrics.random_strings);
+
+    static constexpr const char *histogram =
+        "commence_operation_duration_seconds";
+    WriteHeader(out, histogram, "histogram",
+                "Duration of filesystem and password hash operations.");
+    WriteHistogram(out, histogram, "recursive_copy", metrics.recursive_copy);
+    WriteHistogram(out, histogram, "recursive_delete",
+                   metrics.recursive_delete);
+    WriteHistogram(out, histogram, "copy_template", metrics.copy_template);
+    WriteHistogram(out, histogram, "extract_archive",
+                   metrics.extract_archive);
+    WriteHistogram(out, histogram, "pwhash", metrics.pwhash);
+
+    FileWriter writer{FileDescriptor{AT_FDCWD}, path};
+    writer.Write(AsBytes(std::string_view{out}));
+    writer.Commit();
+}
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileDescriptor.hxx"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * A latency histogram with fixed buckets.  All methods are
+ * thread-safe, because operations may run in the #WorkerPool.
+ */
+class Histogram {
+  public:
+    /**
+     * Upper bounds of the buckets in seconds (not including the
+     * implicit "+Inf" bucket).
+     */
+    static constexpr std::array<double, 10> bounds{
+        0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60,
+    };
+
+  private:
+    /**
+     * Non-cumulative counters; the last one is "+Inf".
+     */
+    std::array<std::atomic<uint_least64_t>, bounds.size() + 1> buckets{};
+
+    std::atomic<uint_least64_t> sum_ns{0};
+
+  public:
+    void Observe(std::chrono::steady_clock::duration d) noexcept;
+
+    uint_least64_t GetBucket(std::size_t i) const noexcept {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+
+    uint_least64_t GetCount() const noexcept;
+
+    double GetSum() const noexcept {
+        return sum_ns.load(std::memory_order_relaxed) / 1e9;
+    }
+};
+
+/**
+ * Measures the duration of the enclosing scope and adds it to a
+ * #Histogram.
+ */
+class ScopeTimer {
+    Histogram &histogram;
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+  public:
+    explicit ScopeTimer(Histogram &_histogram) noexcept
+        : histogram(_histogram) {}
+
+    ~ScopeTimer() noexcept {
+        histogram.Observe(std::chrono::steady_clock::now() - start);
+    }
+
+    ScopeTimer(const ScopeTimer &) = delete;
+    ScopeTimer &operator=(const ScopeTimer &) = delete;
+};
+
+/**
+ * Counters collected during one run; they are written by
+ * WriteMetrics() at exit.
+ */
+struct Metrics {
+    /**
+     * Collect counters which are expensive to obtain (see
+     * CountCopiedTree())?  Only set if the metrics are going to be
+     * written.
+     */
+    bool enabled = false;
+
+    std::chrono::steady_clock::duration run_duration{}, lua_duration{};
+
+    Histogram recursive_copy, recursive_delete, copy_template,
+        extract_archive, pwhash;
+
+    std::atomic<uint_least64_t> rendered_bytes{0}, extracted_bytes{0},
+        files_created{0}, random_strings{0}, copied_bytes{0},
+        deleted_bytes{0}, deleted_files{0};
+};
+
+extern Metrics metrics;
+
+/**
+ * Add the size and the number of regular files of the given
+ * recursive_copy() source to #metrics (only if enabled).  RecursiveCopy()
+ * does not report what it has copied, so this walks the source
+ * tree; errors are ignored.
+ */
+void CountCopiedTree(FileDescriptor directory_fd, const char *path) noexcept;
+
+/**
+ * Like CountCopiedTree(), but for recursive_delete(); must be called
+ * before deleting.
+ */
+void CountDeletedTree(FileDescriptor directory_fd, const char *path) noexcept;
+
+/**
+ * Write all #metrics to the given file in the Prometheus text
+ * exposition format (suitable for node_exporter's textfile
+ * collector).  The file is replaced atomically.
+ *
+ * Throws on error.
+ */
+void WriteMetrics(const char *path, bool success);
@@ -6,6 +6,7 @@
 #include "io/UniqueFileDescriptor.hxx"
 #include "lua/Class.hxx"
 #include "lua/Value.hxx"
+#include "system/Error.hxx"
 
 extern "C" {
 #include <lauxlib.h>
@@ -18,35 +19,77 @@ extern "C" {
 #include <string.h>
 
 class PathDescriptor {
+    /**
+     * The directory itself or (if #relative_path is not empty) the
+     * directory which #relative_path is relative to; undefined
+     * means AT_FDCWD.
+     */
     UniqueFileDescriptor fd;
+
+    /**
+     * Empty if #fd refers to the directory itself.  Otherwise, the
+     * directory has not been created yet (plan mode) and is
+     * referred to by this path relative to #fd.
+     */
+    std::string relative_path;
+
     std::string path;
 
   public:
     PathDescriptor(UniqueFileDescriptor &&_fd, std::string_view _path) noexcept
         : fd(std::move(_fd)), path(_path) {}
 
+    PathDescriptor(UniqueFileDescriptor &&_fd, std::string_view _relative_path,
+                   std::string_view _path) noexcept
+        : fd(std::move(_fd)), relative_path(_relative_path), path(_path) {}
+
     const std::string &GetPath() const noexcept { return path; }
 
-    operator PathReference() const noexcept { return {fd, ""}; }
+    operator PathReference() const noexcept {
+        return {fd.IsDefined() ? FileDescriptor{fd} : FileDescriptor{AT_FDCWD},
+                relative_path.c_str()};
+    }
 
     static int ToString(lua_State *L);
     static int Concat(lua_State *L);
     static int Div(lua_State *L);
 };
 
+/**
+ * Combine the relative path of a #PathReference with another
+ * relative path.
+ */
+static std::string CombineRelativePath(const PathReference &base,
+                                       std::string_view path) noexcept {
+    if (*base.relative_path == 0)
+        return std::string{path};
+
+    std::string result = base.relative_path;
+    result.push_back('/');
+    result.append(path);
+    return result;
+}
+
 class RelativePath {
     Lua::Value l_base;
     const PathDescriptor &base;
     std::string path;
 
+    /**
+     * The path relative to the directory_fd of #base (which differs
+     * from #path if #base is a deferred directory).
+     */
+    std::string relative_path;
+
   public:
     RelativePath(lua_State *L, Lua::StackIndex base_idx,
                  const PathDescriptor &_base, std::string_view _path) noexcept
-        : l_base(L, base_idx), base(_base), path(_path) {}
+        : l_base(L, base_idx), base(_base), path(_path),
+          relative_path(CombineRelativePath(_base, _path)) {}
 
     operator PathReference() const noexcept {
         const PathReference b = base;
-        return {b.directory_fd, path.c_str()};
+        return {b.directory_fd, relative_path.c_str()};
     }
 
     std::string GetPath() const noexcept { return base.GetPath() + "/" + path; }
@@ -176,6 +219,18 @@ void NewLuaPathDescriptor(lua_State *L, UniqueFileDescriptor src,
     LuaPathDescriptor::New(L, std::move(src), path);
 }
 
+void NewLuaDeferredPathDescriptor(lua_State *L, PathReference location,
+                                  std::string_view path) {
+    UniqueFileDescriptor fd;
+    if (location.directory_fd.Get() != AT_FDCWD) {
+        fd = location.directory_fd.Duplicate();
+        if (!fd.IsDefined())
+            throw MakeErrno("Failed to duplicate file descriptor");
+    }
+
+    LuaPathDescriptor::New(L, std::move(fd), location.relative_path, path);
+}
+
 PathReference GetLuaPath(lua_State *L, int idx) {
     if (lua_isstring(L, idx)) {
         return {FileDescriptor{AT_FDCWD}, lua_tostring(L, idx)};
@@ -23,6 +23,14 @@ void RegisterLuaPath(lua_State *L) noexcept;
 void NewLuaPathDescriptor(lua_State *L, UniqueFileDescriptor src,
                           std::string_view path);
 
+/**
+ * Push a "PathDescriptor" for a directory which does not exist yet
+ * (because its creation was recorded in a #Plan).  Paths derived
+ * from it are resolved relative to #location.
+ */
+void NewLuaDeferredPathDescriptor(lua_State *L, PathReference location,
+                                  std::string_view path);
+
 PathReference GetLuaPath(lua_State *L, int idx);
 
 std::string GetLuaPathString(lua_State *L, int idx);
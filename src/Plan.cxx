@@ -0,0 +1,645 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Plan.hxx"
+#include "Metrics.hxx"
+#include "Path.hxx"
+#include "io/FileWriter.hxx"
+#include "io/MakeDirectory.hxx"
+#include "io/RecursiveCopy.hxx"
+#include "io/RecursiveDelete.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "system/Error.hxx"
+#include "util/SpanCast.hxx"
+
+#ifdef HAVE_JSON
+#include <nlohmann/json.hpp>
+#endif
+
+#include <algorithm>
+#include <utility> // for std::unreachable()
+
+#include <errno.h>
+#include <fcntl.h> // for AT_FDCWD
+#include <limits.h> // for PATH_MAX
+#include <stdio.h> // for snprintf()
+#include <stdlib.h> // for realpath()
+#include <sys/stat.h>
+#include <unistd.h> // for getcwd(), readlink()
+
+/**
+ * Determine the absolute path of a directory file descriptor.
+ * Returns an empty string on error.
+ */
+static std::string GetDirectoryPath(FileDescriptor fd) {
+    char buffer[PATH_MAX];
+
+    if (fd.Get() == AT_FDCWD)
+        return getcwd(buffer, sizeof(buffer)) != nullptr ? buffer : "";
+
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd.Get());
+
+    const auto length = readlink(proc_path, buffer, sizeof(buffer));
+    if (length <= 0 || std::size_t(length) >= sizeof(buffer) ||
+        buffer[0] != '/')
+        return {};
+
+    return {buffer, std::size_t(length)};
+}
+
+/**
+ * Normalize an absolute path lexically: collapse duplicate slashes,
+ * remove "." components and trailing slashes, and apply ".."
+ * components.
+ */
+static std::string NormalizePath(std::string_view path) {
+    std::string result;
+
+    while (!path.empty()) {
+        const auto slash = path.find('/');
+        const auto name = path.substr(0, slash);
+        path = slash == path.npos ? std::string_view{} : path.substr(slash + 1);
+
+        if (name.empty() || name == ".")
+            continue;
+
+        if (name == "..") {
+            const auto parent = result.rfind('/');
+            result.resize(parent == result.npos ? 0 : parent);
+            continue;
+        }
+
+        result.push_back('/');
+        result.append(name);
+    }
+
+    if (result.empty())
+        result.push_back('/');
+
+    return result;
+}
+
+/**
+ * Resolve symlinks in the longest prefix of the given absolute path
+ * which exists now; the rest (which will be created by the plan) is
+ * normalized lexically.  Returns an empty string on error.
+ */
+static std::string ResolveExisting(std::string_view path) {
+    std::string prefix{path};
+    while (true) {
+        char buffer[PATH_MAX];
+        if (realpath(prefix.c_str(), buffer) != nullptr) {
+            std::string result = buffer;
+            result.push_back('/');
+            result.append(std::string_view{path}.substr(prefix.size()));
+            return NormalizePath(result);
+        }
+
+        if (errno != ENOENT && errno != ENOTDIR)
+            return {};
+
+        /* if the path exists anyway, it is a dangling symlink (or
+           something inside a file): give up */
+        struct stat st;
+        if (lstat(prefix.c_str(), &st) == 0)
+            return {};
+
+        const auto slash = prefix.rfind('/');
+        if (slash == prefix.npos)
+            return {};
+
+        prefix.resize(slash > 0 ? slash : 1);
+    }
+}
+
+/**
+ * Determine the normalized absolute path of the given location.
+ * Symlinks are resolved only in the parent directory, because
+ * RecursiveDelete() operates on a symlink in the last component
+ * itself, while other operations follow it.
+ *
+ * @param literal_symlink if the last component is a symlink, refer
+ * to the symlink itself; if false, return an empty string (i.e.
+ * unknown) in this case
+ * @return the resolved path or an empty string on error
+ */
+static std::string ResolvePath(FileDescriptor directory_fd,
+                               std::string_view relative_path,
+                               bool literal_symlink) {
+    std::string path;
+    if (!relative_path.starts_with('/')) {
+        path = GetDirectoryPath(directory_fd);
+        if (path.empty())
+            return {};
+
+        path.push_back('/');
+    }
+
+    path.append(relative_path);
+
+    while (path.size() > 1 && path.ends_with('/'))
+        path.pop_back();
+
+    const auto slash = path.rfind('/');
+    const std::string_view name = std::string_view{path}.substr(slash + 1);
+    if (name.empty() || name == "." || name == "..")
+        /* the last component cannot be a symlink */
+        return ResolveExisting(path);
+
+    std::string result =
+        ResolveExisting(slash > 0 ? std::string_view{path}.substr(0, slash)
+                                  : std::string_view{"/"});
+    if (result.empty())
+        return {};
+
+    if (result != "/")
+        result.push_back('/');
+    result.append(name);
+
+    struct stat st;
+    if (!literal_symlink && lstat(result.c_str(), &st) == 0 &&
+        S_ISLNK(st.st_mode))
+        return {};
+
+    return result;
+}
+
+static constexpr const char *ToString(Plan::Type type) noexcept {
+    switch (type) {
+    case Plan::Type::MAKE_DIRECTORY:
+        return "make_directory";
+
+    case Plan::Type::RECURSIVE_COPY:
+        return "recursive_copy";
+
+    case Plan::Type::EXTRACT_ARCHIVE:
+        return "extract_archive";
+
+    case Plan::Type::COPY_TEMPLATE:
+        return "copy_template";
+
+    case Plan::Type::RECURSIVE_DELETE:
+        return "recursive_delete";
+    }
+
+    std::unreachable();
+}
+
+Plan::Path::Path(const PathReference &src, std::string_view _display)
+    : directory_fd(src.directory_fd), relative_path(src.relative_path),
+      display(_display) {
+    if (directory_fd.Get() != AT_FDCWD) {
+        owned_fd = src.directory_fd.Duplicate();
+        if (!owned_fd.IsDefined())
+            throw MakeErrno("Failed to duplicate file descriptor");
+        directory_fd = owned_fd;
+    }
+}
+
+/**
+ * Is #path equal to #base or somewhere inside it?  Returns false if
+ * this cannot be proven.
+ */
+[[gnu::pure]]
+static bool IsBelow(const Plan::Path &path, const Plan::Path &base) noexcept {
+    const std::string_view p = path.resolved, b = base.resolved;
+    return !p.empty() && !b.empty() && p.starts_with(b) &&
+           (p.size() == b.size() || p[b.size()] == '/' || b == "/");
+}
+
+/**
+ * Is #path somewhere inside #base (but not equal)?  Returns true if
+ * this cannot be ruled out.
+ */
+[[gnu::pure]]
+static bool MayBeInside(const Plan::Path &path,
+                        const Plan::Path &base) noexcept {
+    return path.resolved.empty() || base.resolved.empty() ||
+           (IsBelow(path, base) && path.resolved != base.resolved);
+}
+
+/**
+ * May the two paths refer to the same file or may one of them be
+ * inside the other?  Returns true if this cannot be ruled out.
+ */
+[[gnu::pure]]
+static bool MayOverlap(const Plan::Path &a, const Plan::Path &b) noexcept {
+    return a.resolved.empty() || b.resolved.empty() || IsBelow(a, b) ||
+           IsBelow(b, a);
+}
+
+/**
+ * Does the operation read from somewhere inside #path?
+ */
+[[gnu::pure]]
+static bool ReadsFrom(const Plan::Operation &o,
+                      const Plan::Path &path) noexcept {
+    return o.source && MayOverlap(*o.source, path);
+}
+
+/**
+ * May the operation create symlinks inside its destination?
+ */
+[[gnu::pure]]
+static bool MayCreateSymlinks(const Plan::Operation &o) noexcept {
+    return o.type == Plan::Type::RECURSIVE_COPY ||
+           o.type == Plan::Type::EXTRACT_ARCHIVE;
+}
+
+/**
+ * Determine which operations may access something other than their
+ * resolved paths suggest, because an earlier operation may create a
+ * symlink above them (copies and archives may contain symlinks).
+ * These operations are never dropped or reordered.
+ */
+static std::vector<bool>
+FindRedirected(const std::vector<Plan::Operation> &operations) {
+    std::vector<bool> result(operations.size());
+
+    for (std::size_t i = 0; i < operations.size(); ++i) {
+        const auto &o = operations[i];
+
+        for (std::size_t k = 0; k < i && !result[i]; ++k) {
+            const auto &earlier = operations[k];
+            if (!MayCreateSymlinks(earlier))
+                continue;
+
+            result[i] = MayBeInside(o.destination, earlier.destination) ||
+                        (o.source &&
+                         MayBeInside(*o.source, earlier.destination));
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Fill Plan::Path::resolved.  This is done only when the path is
+ * added to the plan, because Plan::Path is also used by async_*()
+ * builtins which do not need it.
+ *
+ * @param literal_symlink see ResolvePath()
+ */
+static Plan::Path &&Resolve(Plan::Path &&path,
+                            bool literal_symlink = false) {
+    path.resolved = ResolvePath(path.directory_fd, path.relative_path,
+                                literal_symlink);
+    return std::move(path);
+}
+
+void Plan::AddMakeDirectory(Path &&path) {
+    operations.emplace_back(Type::MAKE_DIRECTORY, Resolve(std::move(path)));
+}
+
+void Plan::AddRecursiveCopy(Path &&source, Path &&destination) {
+    struct stat st;
+    if (fstatat(source.directory_fd.Get(), source.relative_path.c_str(), &st,
+                AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+        st.st_ino = 0;
+
+    auto &o = operations.emplace_back(Type::RECURSIVE_COPY,
+                                      Resolve(std::move(destination)));
+    o.source.emplace(Resolve(std::move(source)));
+    o.source_inode = st.st_ino;
+}
+
+void Plan::AddCopyTemplate(std::string &&contents, Path &&destination) {
+    auto &o = operations.emplace_back(Type::COPY_TEMPLATE,
+                                      Resolve(std::move(destination)));
+    o.contents = std::move(contents);
+}
+
+void Plan::AddExtractArchive(Path &&source, Path &&destination,
+                             ArchiveTemplates &&templates) {
+    auto &o = operations.emplace_back(Type::EXTRACT_ARCHIVE,
+                                      Resolve(std::move(destination)));
+    o.source.emplace(Resolve(std::move(source)));
+    o.templates = std::move(templates);
+}
+
+void Plan::AddRecursiveDelete(Path &&path) {
+    /* RecursiveDelete() does not follow a symlink in the last
+       component */
+    operations.emplace_back(Type::RECURSIVE_DELETE,
+                            Resolve(std::move(path), true));
+}
+
+void Plan::CheckUnmodified(Path &&_path) const {
+    const auto &path = Resolve(std::move(_path));
+
+    for (const auto &o : operations) {
+        /* creating directories does not modify existing files */
+        if (o.type == Type::MAKE_DIRECTORY)
+            continue;
+
+        if (MayOverlap(o.destination, path))
+            throw FmtRuntimeError("Cannot read {} in plan mode because it "
+                                  "may be modified by {}({}) first",
+                                  path.display, ToString(o.type),
+                                  o.destination.display);
+    }
+}
+
+/**
+ * Is the result of operation #i made obsolete by a later operation,
+ * without being read or used in between?
+ *
+ * @return the operation which makes #i obsolete or nullptr
+ *
+ * @param dropped operations after #i which have already been found
+ * to be obsolete
+ */
+[[gnu::pure]]
+static const Plan::Operation *
+IsOverwritten(const std::vector<Plan::Operation> &operations,
+              const std::vector<bool> &redirected,
+              const std::vector<bool> &dropped, std::size_t i) noexcept {
+    if (redirected[i])
+        return nullptr;
+
+    const auto &o = operations[i];
+    const auto &path = o.destination;
+
+    for (std::size_t j = i + 1; j < operations.size(); ++j) {
+        if (dropped[j])
+            continue;
+
+        const auto &later = operations[j];
+        if (redirected[j] || ReadsFrom(later, path))
+            return nullptr;
+
+        switch (later.type) {
+        case Plan::Type::RECURSIVE_DELETE:
+            /* deleting the destination (or one of its parents)
+               makes all earlier writes (and deletes) obsolete */
+            if (IsBelow(path, later.destination))
+                return &later;
+            break;
+
+        case Plan::Type::COPY_TEMPLATE:
+            /* a template overwrites an earlier template
+               completely */
+            if (o.type == Plan::Type::COPY_TEMPLATE &&
+                !path.resolved.empty() &&
+                path.resolved == later.destination.resolved)
+                return &later;
+            break;
+
+        case Plan::Type::MAKE_DIRECTORY:
+        case Plan::Type::RECURSIVE_COPY:
+        case Plan::Type::EXTRACT_ARCHIVE:
+            break;
+        }
+
+        /* the later operation may need the result (e.g. it
+           writes into a directory created by #o) */
+        if (MayOverlap(later.destination, path))
+            return nullptr;
+    }
+
+    return nullptr;
+}
+
+/**
+ * Return the parent of a resolved (absolute) path or an empty
+ * string if there is none.
+ */
+[[gnu::pure]]
+static std::string_view GetParentPath(std::string_view path) noexcept {
+    const auto slash = path.rfind('/');
+    if (slash == path.npos || path == "/")
+        return {};
+
+    return slash > 0 ? path.substr(0, slash) : "/";
+}
+
+/**
+ * Is #MAKE_DIRECTORY operation #i redundant because an earlier
+ * operation has already created the directory (or one inside it)
+ * and nothing in between may have removed it?
+ */
+[[gnu::pure]]
+static bool IsRedundantMakeDirectory(
+    const std::vector<Plan::Operation> &operations,
+    const std::vector<bool> &redirected, std::size_t i) noexcept {
+    const auto &path = operations[i].destination;
+
+    for (std::size_t k = i; k-- > 0;) {
+        const auto &earlier = operations[k];
+
+        switch (earlier.type) {
+        case Plan::Type::MAKE_DIRECTORY:
+            if (!redirected[k] && IsBelow(earlier.destination, path))
+                return true;
+            break;
+
+        case Plan::Type::COPY_TEMPLATE:
+            break;
+
+        case Plan::Type::RECURSIVE_COPY:
+        case Plan::Type::EXTRACT_ARCHIVE:
+        case Plan::Type::RECURSIVE_DELETE:
+            /* may have deleted or replaced the directory */
+            if (path.resolved.empty() || earlier.destination.resolved.empty() ||
+                IsBelow(path, earlier.destination))
+                return false;
+            break;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * May the two operations be executed in any order?
+ */
+[[gnu::pure]]
+static bool AreIndependent(const Plan::Operation &a,
+                           const Plan::Operation &b) noexcept {
+    if (a.type == Plan::Type::RECURSIVE_DELETE ||
+        b.type == Plan::Type::RECURSIVE_DELETE)
+        return false;
+
+    /* creating nested directories is idempotent, but everything
+       else may need the directory */
+    if (a.type == Plan::Type::MAKE_DIRECTORY ||
+        b.type == Plan::Type::MAKE_DIRECTORY)
+        return a.type == b.type;
+
+    return !MayOverlap(a.destination, b.destination) &&
+           !ReadsFrom(a, b.destination) && !ReadsFrom(b, a.destination);
+}
+
+void Plan::Optimize() noexcept {
+    /* pass 1: drop operations whose result is deleted or
+       overwritten later (backwards, so operations which are
+       obsolete themselves do not keep earlier ones alive) */
+    auto redirected = FindRedirected(operations);
+    std::vector<bool> dropped(operations.size());
+    for (std::size_t i = operations.size(); i-- > 0;) {
+        const auto *obsoleted_by =
+            IsOverwritten(operations, redirected, dropped, i);
+        if (obsoleted_by == nullptr)
+            continue;
+
+        auto &o = operations[i];
+        if (o.type == Type::MAKE_DIRECTORY &&
+            obsoleted_by->type == Type::RECURSIVE_DELETE) {
+            /* MakeNestedDirectory() may have created parent
+               directories which survive the delete; create
+               those instead */
+            const auto parent =
+                GetParentPath(obsoleted_by->destination.resolved);
+            if (!parent.empty()) {
+                const std::string parent_path{parent};
+                o.destination = Resolve(Path{{FileDescriptor{AT_FDCWD},
+                                              parent_path.c_str()},
+                                             parent_path});
+                continue;
+            }
+        }
+
+        dropped[i] = true;
+    }
+
+    std::vector<Operation> result;
+    result.reserve(operations.size());
+    for (std::size_t i = 0; i < operations.size(); ++i)
+        if (!dropped[i])
+            result.emplace_back(std::move(operations[i]));
+
+    operations = std::move(result);
+
+    /* pass 2: merge directory creations */
+    redirected = FindRedirected(operations);
+    dropped.assign(operations.size(), false);
+    for (std::size_t i = 0; i < operations.size(); ++i)
+        dropped[i] = operations[i].type == Type::MAKE_DIRECTORY &&
+                     !redirected[i] &&
+                     IsRedundantMakeDirectory(operations, redirected, i);
+
+    result.clear();
+    for (std::size_t i = 0; i < operations.size(); ++i)
+        if (!dropped[i])
+            result.emplace_back(std::move(operations[i]));
+
+    operations = std::move(result);
+
+    /* pass 3: within runs of mutually independent operations,
+       execute copies in source inode order (which is usually the
+       on-disk order) and templates grouped by destination
+       directory */
+    redirected = FindRedirected(operations);
+    std::size_t begin = 0;
+    while (begin < operations.size()) {
+        std::size_t end = begin + 1;
+        while (end < operations.size() && !redirected[end] &&
+               !redirected[begin] &&
+               std::all_of(operations.begin() + begin,
+                           operations.begin() + end,
+                           [this, end](const Operation &o) {
+                               return AreIndependent(o, operations[end]);
+                           }))
+            ++end;
+
+        std::stable_sort(operations.begin() + begin, operations.begin() + end,
+                         [](const Operation &a, const Operation &b) {
+                             if (a.type != b.type)
+                                 return a.type < b.type;
+
+                             if (a.type == Type::RECURSIVE_COPY)
+                                 return a.source_inode < b.source_inode;
+
+                             return a.destination.resolved <
+                                    b.destination.resolved;
+                         });
+
+        begin = end;
+    }
+}
+
+void Plan::Execute() const {
+    for (const auto &o : operations) {
+        switch (o.type) {
+        case Type::MAKE_DIRECTORY:
+            MakeNestedDirectory(o.destination.directory_fd,
+                                o.destination.relative_path.c_str());
+            break;
+
+        case Type::RECURSIVE_COPY: {
+            CountCopiedTree(o.source->directory_fd,
+                            o.source->relative_path.c_str());
+
+            const ScopeTimer timer{metrics.recursive_copy};
+            RecursiveCopy(o.source->directory_fd,
+                          o.source->relative_path.c_str(),
+                          o.destination.directory_fd,
+                          o.destination.relative_path.c_str());
+            break;
+        }
+
+        case Type::EXTRACT_ARCHIVE: {
+            const ScopeTimer timer{metrics.extract_archive};
+            ExtractArchive({o.source->directory_fd,
+                            o.source->relative_path.c_str()},
+                           {o.destination.directory_fd,
+                            o.destination.relative_path.c_str()},
+                           o.templates);
+            break;
+        }
+
+        case Type::COPY_TEMPLATE: {
+            const ScopeTimer timer{metrics.copy_template};
+            FileWriter writer{o.destination.directory_fd,
+                              o.destination.relative_path.c_str()};
+            writer.Write(AsBytes(std::string_view{o.contents}));
+            writer.Commit();
+            ++metrics.files_created;
+            break;
+        }
+
+        case Type::RECURSIVE_DELETE: {
+            CountDeletedTree(o.destination.directory_fd,
+                             o.destination.relative_path.c_str());
+
+            const ScopeTimer timer{metrics.recursive_delete};
+            RecursiveDelete(o.destination.directory_fd,
+                            o.destination.relative_path.c_str());
+            break;
+        }
+        }
+    }
+}
+
+#ifdef HAVE_JSON
+
+nlohmann::json Plan::ToJson() const {
+    auto j = nlohmann::json::array();
+
+    for (const auto &o : operations) {
+        nlohmann::json item{
+            {"operation", ToString(o.type)},
+            {"destination", o.destination.display},
+        };
+
+        if (o.source)
+            item["source"] = o.source->display;
+
+        if (o.type == Type::COPY_TEMPLATE)
+            item["size"] = o.contents.size();
+
+        if (o.type == Type::EXTRACT_ARCHIVE && !o.templates.empty()) {
+            auto &templates = item["templates"] = nlohmann::json::array();
+            for (const auto &[name, contents] : o.templates)
+                templates.push_back(name);
+        }
+
+        j.push_back(std::move(item));
+    }
+
+    return j;
+}
+
+#endif // HAVE_JSON
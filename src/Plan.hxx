@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Archive.hxx"
+#include "io/FileDescriptor.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "config.h"
+
+#ifdef HAVE_JSON
+#include <nlohmann/json_fwd.hpp>
+#endif
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+struct PathReference;
+
+/**
+ * A list of filesystem operations recorded by the Lua builtins
+ * instead of being executed immediately.  After the script has
+ * finished, the plan can be optimized, dumped and executed in one
+ * pass.
+ */
+class Plan {
+  public:
+    /**
+     * A copy of a #PathReference which owns its directory file
+     * descriptor, because the Lua object it was obtained from may
+     * be garbage-collected before the plan is executed.
+     */
+    struct Path {
+        UniqueFileDescriptor owned_fd;
+        FileDescriptor directory_fd;
+        std::string relative_path;
+
+        /**
+         * The path as seen by the script; used for dumping the
+         * plan.
+         */
+        std::string display;
+
+        /**
+         * The normalized absolute path (with symlinks resolved as
+         * far as the path exists at the time it was recorded);
+         * used for comparing paths.  It is determined only when
+         * the path is added to the #Plan.  Empty if it could not
+         * be determined, which means the path may overlap with
+         * any other path.
+         */
+        std::string resolved;
+
+        Path(const PathReference &src, std::string_view _display);
+    };
+
+    enum class Type {
+        MAKE_DIRECTORY,
+        RECURSIVE_COPY,
+        EXTRACT_ARCHIVE,
+        COPY_TEMPLATE,
+        RECURSIVE_DELETE,
+    };
+
+    struct Operation {
+        Type type;
+
+        /**
+         * Unused for #MAKE_DIRECTORY, #RECURSIVE_DELETE and
+         * #COPY_TEMPLATE (the template has already been rendered
+         * into #contents).
+         */
+        std::optional<Path> source;
+
+        Path destination;
+
+        /**
+         * The rendered template (only #COPY_TEMPLATE).
+         */
+        std::string contents;
+
+        /**
+         * The rendered template members (only #EXTRACT_ARCHIVE).
+         */
+        ArchiveTemplates templates;
+
+        /**
+         * The inode number of the source (only #RECURSIVE_COPY);
+         * used to order copies.
+         */
+        ino_t source_inode = 0;
+
+        Operation(Type _type, Path &&_destination) noexcept
+            : type(_type), destination(std::move(_destination)) {}
+    };
+
+  private:
+    std::vector<Operation> operations;
+
+  public:
+    void AddMakeDirectory(Path &&path);
+    void AddRecursiveCopy(Path &&source, Path &&destination);
+    void AddCopyTemplate(std::string &&contents, Path &&destination);
+    void AddExtractArchive(Path &&source, Path &&destination,
+                           ArchiveTemplates &&templates);
+    void AddRecursiveDelete(Path &&path);
+
+    /**
+     * Throw if the given path may be modified by an operation which
+     * has been recorded but not yet executed.  This is used by
+     * builtins which read files at record time (e.g. templates,
+     * which need the Lua state); they cannot be deferred, and would
+     * otherwise see the old contents.
+     */
+    void CheckUnmodified(Path &&path) const;
+
+    /**
+     * Remove redundant operations and reorder independent ones.
+     */
+    void Optimize() noexcept;
+
+    /**
+     * Execute all operations.  Throws on error.
+     */
+    void Execute() const;
+
+#ifdef HAVE_JSON
+    nlohmann::json ToJson() const;
+#endif
+};
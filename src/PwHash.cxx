@@ -3,6 +3,8 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "PwHash.hxx"
+#include "Async.hxx"
+#include "Metrics.hxx"
 #include "lua/Error.hxx"
 #include "lua/Util.hxx"
 #include "system/Error.hxx"
@@ -22,6 +24,8 @@ extern "C" {
 
 #include <array>
 #include <stdexcept>
+#include <string>
+#include <utility> // for std::unreachable()
 
 using std::string_view_literals::operator""sv;
 
@@ -85,15 +89,14 @@ struct PwHashArgon2id {
 };
 
 template <typename PwHash>
-static int l_sodium_pwhash(lua_State *L, std::string_view password) {
+static std::string SodiumPwHash(std::string_view password) {
     char hash[PwHash::STRBYTES];
     if (PwHash::str(hash, password.data(), password.size(),
                     PwHash::OPSLIMIT_INTERACTIVE,
                     PwHash::MEMLIMIT_INTERACTIVE) != 0)
         throw std::runtime_error("crypto_pwhash_str() failed");
 
-    lua_pushstring(L, hash);
-    return 1;
+    return hash;
 }
 
 #ifdef HAVE_LIBCRYPT
@@ -125,48 +128,119 @@ static auto GenerateCryptSalt() {
     return salt;
 }
 
-static int l_sha512_pwhash(lua_State *L, const char *password) {
+static std::string Sha512PwHash(const char *password) {
     struct crypt_data crypt_data{};
     const auto salt = GenerateCryptSalt();
     const char *hash = crypt_r(password, salt.data(), &crypt_data);
     if (hash == nullptr)
         throw MakeErrno("crypt_r() failed");
 
-    lua_pushstring(L, hash);
-    return 1;
+    return hash;
 }
 
 #endif // HAVE_LIBCRYPT
 
+enum class PwHashAlgorithm {
+    DEFAULT,
+    ARGON2I,
+    ARGON2ID,
+#ifdef HAVE_LIBCRYPT
+    SHA512,
+#endif
+};
+
+static PwHashAlgorithm CheckPwHashAlgorithm(lua_State *L, int idx) {
+    const auto setting = OptString(L, idx);
+
+    if (setting.empty())
+        return PwHashAlgorithm::DEFAULT;
+    else if (setting == crypto_pwhash_argon2i_STRPREFIX)
+        return PwHashAlgorithm::ARGON2I;
+    else if (setting == crypto_pwhash_argon2id_STRPREFIX)
+        return PwHashAlgorithm::ARGON2ID;
+#ifdef HAVE_LIBCRYPT
+    else if (setting == "$6$"sv)
+        return PwHashAlgorithm::SHA512;
+#endif
+    else {
+        luaL_argerror(L, idx, "Unrecognized setting");
+        abort();
+    }
+}
+
+/**
+ * Calculate the password hash.  This does not access the Lua state
+ * and may therefore be called from a worker thread.
+ *
+ * @param password a null-terminated string
+ */
+static std::string PwHash(PwHashAlgorithm algorithm,
+                          const std::string &password) {
+    const ScopeTimer timer{metrics.pwhash};
+
+    switch (algorithm) {
+    case PwHashAlgorithm::DEFAULT:
+        return SodiumPwHash<PwHashDefault>(password);
+
+    case PwHashAlgorithm::ARGON2I:
+        return SodiumPwHash<PwHashArgon2i>(password);
+
+    case PwHashAlgorithm::ARGON2ID:
+        return SodiumPwHash<PwHashArgon2id>(password);
+
+#ifdef HAVE_LIBCRYPT
+    case PwHashAlgorithm::SHA512:
+        return Sha512PwHash(password.c_str());
+#endif
+    }
+
+    std::unreachable();
+}
+
 static int l_pwhash(lua_State *L) {
     const auto password = CheckString(L, 1);
-    const auto setting = OptString(L, 2);
+    const auto algorithm = CheckPwHashAlgorithm(L, 2);
 
     if (lua_gettop(L) > 2)
         return luaL_error(L, "Too many parameters");
 
     try {
-        if (setting.empty())
-            return l_sodium_pwhash<PwHashDefault>(L, password);
-        else if (setting == crypto_pwhash_argon2i_STRPREFIX)
-            return l_sodium_pwhash<PwHashArgon2i>(L, password);
-        else if (setting == crypto_pwhash_argon2id_STRPREFIX)
-            return l_sodium_pwhash<PwHashArgon2id>(L, password);
-#ifdef HAVE_LIBCRYPT
-        else if (setting == "$6$"sv)
-            return l_sha512_pwhash(L, password.data());
-#endif
-        else {
-            luaL_argerror(L, 2, "Unrecognized setting");
-            abort();
-        }
+        Lua::Push(L, PwHash(algorithm, std::string{password}));
+        return 1;
     } catch (...) {
         Lua::RaiseCurrent(L);
     }
 }
 
-void RegisterPwHash(lua_State *L) noexcept {
+/**
+ * Like pwhash(), but the (expensive) hash is calculated by a worker
+ * thread; returns a "Future" which resolves to the hash string.
+ */
+static int l_async_pwhash(lua_State *L) {
+    const auto password = CheckString(L, 1);
+    const auto algorithm = CheckPwHashAlgorithm(L, 2);
+
+    if (lua_gettop(L) > 2)
+        return luaL_error(L, "Too many parameters");
+
+    try {
+        auto &pool = GetLuaWorkerPool(L, 1);
+        NewLuaFuture(L, pool,
+                     pool.Submit([algorithm, s = std::string{password}]() {
+                         return AsyncResult{PwHash(algorithm, s)};
+                     }));
+        return 1;
+    } catch (...) {
+        Lua::RaiseCurrent(L);
+    }
+}
+
+void RegisterPwHash(lua_State *L, WorkerPool &pool) noexcept {
     Lua::SetGlobal(L, "pwhash", l_pwhash);
+
+    lua_pushlightuserdata(L, &pool);
+    lua_pushcclosure(L, l_async_pwhash, 1);
+    lua_setglobal(L, "async_pwhash");
 }
 
 } // namespace Lua
@@ -5,9 +5,10 @@
 #pragma once
 
 struct lua_State;
+class WorkerPool;
 
 namespace Lua {
 
-void RegisterPwHash(lua_State *L) noexcept;
+void RegisterPwHash(lua_State *L, WorkerPool &pool) noexcept;
 
 } // namespace Lua
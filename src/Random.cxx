@@ -3,6 +3,7 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Random.hxx"
+#include "Metrics.hxx"
 
 #include "lua/Class.hxx"
 
@@ -71,6 +72,7 @@ int Random::Make(lua_State *L) {
     for (lua_Integer i = 0; i < length; i++)
         buffer[i] = rd.alphabet[rd.d(prng)];
     buffer[length] = 0;
+    ++metrics.random_strings;
     Lua::Push(L, buffer);
     return 1;
 }
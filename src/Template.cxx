@@ -3,6 +3,8 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Template.hxx"
+#include "FindDouble.hxx"
+#include "Metrics.hxx"
 #include "lua/Assert.hxx"
 #include "lua/Error.hxx"
 #include "util/ScopeExit.hxx"
@@ -14,25 +16,29 @@ extern "C" {
 #include <stdexcept>
 #include <string>
 
-using std::string_view_literals::operator""sv;
-
 void RunTemplate(lua_State *L, std::string_view t,
                  TemplateWriteCallback callback) {
+    /* count the output bytes */
+    const auto counted_callback = [&callback](std::string_view s) {
+        metrics.rendered_bytes += s.size();
+        callback(s);
+    };
+
     while (!t.empty()) {
         const Lua::ScopeCheckStack check_stack{L};
 
-        auto i = t.find("{{"sv);
+        auto i = FindDouble(t, '{');
         if (i == t.npos) {
-            callback(t);
+            counted_callback(t);
             break;
         }
 
-        if (i > 0) {
-            callback(t.substr(0, i));
-            t = t.substr(i + 2);
-        }
+        if (i > 0)
+            counted_callback(t.substr(0, i));
+
+        t = t.substr(i + 2);
 
-        i = t.find("}}"sv);
+        i = FindDouble(t, '}');
         if (i == t.npos)
             throw std::invalid_argument{"Missing '}}'"};
 
@@ -49,11 +55,11 @@ void RunTemplate(lua_State *L, std::string_view t,
 
         if (luaL_callmeta(L, -1, "__tostring")) {
             AtScopeExit(L) { lua_pop(L, 1); };
-            callback({lua_tostring(L, -1), lua_strlen(L, -1)});
+            counted_callback({lua_tostring(L, -1), lua_strlen(L, -1)});
         } else {
             size_t length;
             const char *s = lua_tolstring(L, -1, &length);
-            callback({s, length});
+            counted_callback({s, length});
         }
     }
 }
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WorkerPool.hxx"
+
+#include <algorithm>
+
+WorkerPool::~WorkerPool() noexcept {
+    {
+        const std::scoped_lock lock{mutex};
+        quit = true;
+    }
+
+    cond.notify_all();
+
+    for (auto &i : threads)
+        i.join();
+}
+
+std::future<AsyncResult>
+WorkerPool::Submit(std::move_only_function<AsyncResult()> f) {
+    Task task{std::move(f)};
+    auto future = task.get_future();
+
+    {
+        const std::scoped_lock lock{mutex};
+        queue.emplace_back(std::move(task));
+
+        if (threads.size() < max_threads &&
+            n_running + queue.size() > threads.size())
+            threads.emplace_back(&WorkerPool::Run, this);
+    }
+
+    cond.notify_one();
+    return future;
+}
+
+void WorkerPool::WaitIdle() noexcept {
+    std::unique_lock lock{mutex};
+    idle_cond.wait(lock, [this] { return queue.empty() && n_running == 0; });
+}
+
+std::shared_ptr<TrackedTask>
+WorkerPool::Track(std::future<AsyncResult> &&future) {
+    /* forget tasks which have already been awaited */
+    std::erase_if(tracked, [](const auto &i) { return i->awaited; });
+
+    return tracked.emplace_back(
+        std::make_shared<TrackedTask>(std::move(future)));
+}
+
+void WorkerPool::RethrowUnawaited() {
+    WaitIdle();
+
+    for (auto &i : tracked) {
+        if (!i->awaited && i->future.valid()) {
+            i->awaited = true;
+            i->future.get();
+        }
+    }
+
+    tracked.clear();
+}
+
+void WorkerPool::Run() noexcept {
+    std::unique_lock lock{mutex};
+
+    while (true) {
+        cond.wait(lock, [this] { return quit || !queue.empty(); });
+
+        /* finish all pending tasks before quitting */
+        if (queue.empty())
+            break;
+
+        auto task = std::move(queue.front());
+        queue.pop_front();
+        ++n_running;
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        if (--n_running == 0 && queue.empty())
+            idle_cond.notify_all();
+    }
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * The result of a task: an optional string which is returned to
+ * Lua by await().
+ */
+using AsyncResult = std::optional<std::string>;
+
+/**
+ * The future of a task whose result is handed to the script (see
+ * WorkerPool::Track()).
+ */
+struct TrackedTask {
+    std::future<AsyncResult> future;
+
+    /**
+     * Has the script obtained the result (or the error)?
+     */
+    bool awaited = false;
+
+    explicit TrackedTask(std::future<AsyncResult> &&_future) noexcept
+        : future(std::move(_future)) {}
+};
+
+/**
+ * A simple pool of worker threads which runs blocking operations in
+ * the background.  The threads are launched on demand, so scripts
+ * which do not use asynchronous builtins do not pay for them.
+ */
+class WorkerPool {
+    using Task = std::packaged_task<AsyncResult()>;
+
+    std::mutex mutex;
+    std::condition_variable cond, idle_cond;
+    std::deque<Task> queue;
+    std::vector<std::thread> threads;
+
+    /**
+     * The number of tasks currently being executed.
+     */
+    std::size_t n_running = 0;
+
+    const unsigned max_threads;
+
+    bool quit = false;
+
+    /**
+     * Tasks registered with Track().  Only accessed by the thread
+     * which submits tasks, therefore not protected by #mutex.
+     */
+    std::vector<std::shared_ptr<TrackedTask>> tracked;
+
+  public:
+    explicit WorkerPool(unsigned _max_threads) noexcept
+        : max_threads(_max_threads > 0 ? _max_threads : 1) {}
+
+    /**
+     * Waits for all pending tasks to finish.
+     */
+    ~WorkerPool() noexcept;
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    std::future<AsyncResult> Submit(std::move_only_function<AsyncResult()> f);
+
+    /**
+     * Wait until all submitted tasks have finished.
+     */
+    void WaitIdle() noexcept;
+
+    /**
+     * Remember the given future, so RethrowUnawaited() can check
+     * whether the task has failed even if the script never awaits
+     * it.
+     */
+    std::shared_ptr<TrackedTask> Track(std::future<AsyncResult> &&future);
+
+    /**
+     * Wait until all submitted tasks have finished, then rethrow
+     * the first error of a tracked task which has not been awaited.
+     */
+    void RethrowUnawaited();
+
+  private:
+    void Run() noexcept;
+};